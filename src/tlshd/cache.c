@@ -0,0 +1,321 @@
+/*
+ * Share per-peer key share predictions among handshake children.
+ *
+ * Copyright (c) 2023 Oracle and/or its affiliates.
+ *
+ * ktls-utils is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <netdb.h>
+#include <errno.h>
+#include <pthread.h>
+#include <keyutils.h>
+
+#include <gnutls/gnutls.h>
+#include <gnutls/abstract.h>
+
+#include <glib.h>
+
+#include "tlshd.h"
+#include "netlink.h"
+
+/*
+ * The cache remembers which key exchange group each server selected
+ * most recently, so the next ClientHello sent to that server carries
+ * only a key share for that group. A correct prediction avoids the
+ * extra round trip of a HelloRetryRequest, and avoids generating key
+ * shares the server will not use. When the kernel opens many
+ * connections to the same server at once (for example, NFS with
+ * nconnect), every handshake after the first benefits.
+ *
+ * Predictions are never waited for. A handshake that finds no
+ * prediction for its peer simply offers the library's default key
+ * shares.
+ *
+ * The cache lives in an anonymous shared mapping created by the
+ * parent before any children are forked.
+ */
+
+struct tlshd_cache_group {
+	struct sockaddr_storage	addr;
+	gnutls_group_t		group;
+};
+
+struct tlshd_cache {
+	pthread_mutex_t		lock;
+	struct tlshd_cache_group groups[TLSHD_CACHE_ENTRIES];
+};
+
+static struct tlshd_cache *tlshd_cache;
+
+/* State private to the child performing a handshake */
+static gnutls_group_t tlshd_cache_predicted;
+
+/**
+ * tlshd_cache_init - Create the shared peer cache
+ *
+ */
+void tlshd_cache_init(void)
+{
+	pthread_mutexattr_t attr;
+
+	if (!tlshd_config_get_key_share_prediction())
+		return;
+
+	tlshd_cache = mmap(NULL, sizeof(*tlshd_cache), PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (tlshd_cache == MAP_FAILED) {
+		tlshd_log_perror("mmap");
+		tlshd_cache = NULL;
+		return;
+	}
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(&tlshd_cache->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	tlshd_log_debug("Peer cache enabled (%u entries)", TLSHD_CACHE_ENTRIES);
+}
+
+/**
+ * tlshd_cache_shutdown - Release the shared peer cache
+ *
+ */
+void tlshd_cache_shutdown(void)
+{
+	if (!tlshd_cache)
+		return;
+
+	gnutls_memset(tlshd_cache, 0, sizeof(*tlshd_cache));
+	munmap(tlshd_cache, sizeof(*tlshd_cache));
+	tlshd_cache = NULL;
+}
+
+static void tlshd_cache_lock(void)
+{
+	/* A child that died holding the lock leaves the table intact */
+	if (pthread_mutex_lock(&tlshd_cache->lock) == EOWNERDEAD)
+		pthread_mutex_consistent(&tlshd_cache->lock);
+}
+
+static void tlshd_cache_unlock(void)
+{
+	pthread_mutex_unlock(&tlshd_cache->lock);
+}
+
+static guint tlshd_cache_hash_addr(const struct sockaddr_storage *addr)
+{
+	const unsigned char *p = (const unsigned char *)addr;
+	guint hash = 5381;
+	size_t i;
+
+	for (i = 0; i < sizeof(*addr); i++)
+		hash = hash * 33 + p[i];
+	return hash;
+}
+
+/**
+ * tlshd_cache_handshake_hook - Observe handshake messages
+ * @htype: handshake message type
+ * @incoming: true if the message was received from the peer
+ *
+ */
+void tlshd_cache_handshake_hook(unsigned int htype, unsigned int incoming)
+{
+	if (!incoming || htype != GNUTLS_HANDSHAKE_HELLO_RETRY_REQUEST)
+		return;
+
+	tlshd_stats_inc(TLSHD_STAT_HRR);
+	if (tlshd_cache_predicted != GNUTLS_GROUP_INVALID) {
+		tlshd_stats_inc(TLSHD_STAT_HRR_PREDICTED);
+		tlshd_log_debug("Server rejected predicted group %s",
+				gnutls_group_get_name(tlshd_cache_predicted));
+	}
+}
+
+/*
+ * Caller holds the cache lock. Returns the index of the entry for
+ * @addr, or the index of an entry that may be replaced.
+ */
+static unsigned int tlshd_cache_lookup_group(const struct sockaddr_storage *addr,
+					     bool *found)
+{
+	unsigned int i, idx, victim;
+	struct tlshd_cache_group *entry;
+
+	idx = tlshd_cache_hash_addr(addr) % TLSHD_CACHE_ENTRIES;
+	victim = idx;
+	for (i = 0; i < TLSHD_CACHE_PROBES; i++) {
+		unsigned int j = (idx + i) % TLSHD_CACHE_ENTRIES;
+
+		entry = &tlshd_cache->groups[j];
+		if (entry->group == GNUTLS_GROUP_INVALID) {
+			victim = j;
+			continue;
+		}
+		if (!memcmp(&entry->addr, addr, sizeof(*addr))) {
+			*found = true;
+			return j;
+		}
+	}
+
+	*found = false;
+	return victim;
+}
+
+/**
+ * tlshd_cache_predict_group - Look up the group a server chose last time
+ * @parms: handshake parameters
+ *
+ * On return, @parms->key_share_group is set to the group to offer
+ * in the ClientHello's only key share, or to GNUTLS_GROUP_INVALID if
+ * there is no prediction for this peer.
+ */
+void tlshd_cache_predict_group(struct tlshd_handshake_parms *parms)
+{
+	struct sockaddr_storage addr;
+	unsigned int idx;
+	bool found;
+
+	parms->key_share_group = GNUTLS_GROUP_INVALID;
+	tlshd_cache_predicted = GNUTLS_GROUP_INVALID;
+	if (!tlshd_cache || !parms->peeraddr_len)
+		return;
+
+	memset(&addr, 0, sizeof(addr));
+	memcpy(&addr, parms->peeraddr, parms->peeraddr_len);
+
+	tlshd_cache_lock();
+	idx = tlshd_cache_lookup_group(&addr, &found);
+	if (found)
+		parms->key_share_group = tlshd_cache->groups[idx].group;
+	tlshd_cache_unlock();
+
+	if (parms->key_share_group == GNUTLS_GROUP_INVALID)
+		return;
+	tlshd_cache_predicted = parms->key_share_group;
+	tlshd_stats_inc(TLSHD_STAT_KEYSHARE_PREDICTED);
+	tlshd_log_debug("Predicting key exchange group %s",
+			gnutls_group_get_name(parms->key_share_group));
+}
+
+/**
+ * tlshd_cache_remember_group - Record the group a server selected
+ * @session: client session that has completed its handshake
+ * @parms: handshake parameters
+ *
+ */
+void tlshd_cache_remember_group(gnutls_session_t session,
+				struct tlshd_handshake_parms *parms)
+{
+	struct tlshd_cache_group *entry;
+	struct sockaddr_storage addr;
+	gnutls_group_t group;
+	unsigned int idx;
+	bool found;
+
+	if (!tlshd_cache || !parms->peeraddr_len)
+		return;
+	if (parms->handshake_type != HANDSHAKE_MSG_TYPE_CLIENTHELLO)
+		return;
+
+	/* Pure PSK handshakes do not use a key exchange group */
+	group = gnutls_group_get(session);
+	if (group == GNUTLS_GROUP_INVALID)
+		return;
+
+	memset(&addr, 0, sizeof(addr));
+	memcpy(&addr, parms->peeraddr, parms->peeraddr_len);
+
+	tlshd_cache_lock();
+	idx = tlshd_cache_lookup_group(&addr, &found);
+	entry = &tlshd_cache->groups[idx];
+	entry->addr = addr;
+	entry->group = group;
+	tlshd_cache_unlock();
+}
+
+/**
+ * tlshd_cache_flush - Forget every cached group prediction
+ *
+ * Returns the number of entries that were removed.
+ */
+unsigned int tlshd_cache_flush(void)
+{
+	unsigned int i, count = 0;
+
+	if (!tlshd_cache)
+		return 0;
+
+	tlshd_cache_lock();
+	for (i = 0; i < TLSHD_CACHE_ENTRIES; i++) {
+		if (tlshd_cache->groups[i].group != GNUTLS_GROUP_INVALID) {
+			memset(&tlshd_cache->groups[i], 0,
+			       sizeof(tlshd_cache->groups[i]));
+			count++;
+		}
+	}
+	tlshd_cache_unlock();
+	return count;
+}
+
+static void tlshd_cache_format_addr(const struct sockaddr_storage *addr,
+				    char *buf, size_t size)
+{
+	if (getnameinfo((const struct sockaddr *)addr, sizeof(*addr),
+			buf, size, NULL, 0, NI_NUMERICHOST))
+		snprintf(buf, size, "unknown");
+}
+
+/**
+ * tlshd_cache_write_status - Describe the peer cache's contents
+ * @f: stream to write to
+ *
+ */
+void tlshd_cache_write_status(FILE *f)
+{
+	char addr[NI_MAXHOST];
+	unsigned int i;
+
+	if (!tlshd_cache) {
+		fprintf(f, "Peer cache is disabled\n");
+		return;
+	}
+
+	tlshd_cache_lock();
+	for (i = 0; i < TLSHD_CACHE_ENTRIES; i++) {
+		if (tlshd_cache->groups[i].group == GNUTLS_GROUP_INVALID)
+			continue;
+		tlshd_cache_format_addr(&tlshd_cache->groups[i].addr, addr,
+					sizeof(addr));
+		fprintf(f, "group %s: %s\n", addr,
+			gnutls_group_get_name(tlshd_cache->groups[i].group));
+	}
+	tlshd_cache_unlock();
+}
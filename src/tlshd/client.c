@@ -45,6 +45,17 @@
 static unsigned int tlshd_num_remote_peerids;
 static key_serial_t tlshd_remote_peerid[10];
 
+static unsigned int
+tlshd_client_init_flags(struct tlshd_handshake_parms *parms)
+{
+	unsigned int flags = GNUTLS_CLIENT;
+
+	/* Send only the key share the server is expected to select */
+	if (parms->key_share_group != GNUTLS_GROUP_INVALID)
+		flags |= GNUTLS_KEY_SHARE_TOP;
+	return flags;
+}
+
 static void tlshd_client_anon_handshake(struct tlshd_handshake_parms *parms)
 {
 	gnutls_certificate_credentials_t xcred;
@@ -73,7 +84,7 @@ static void tlshd_client_anon_handshake(struct tlshd_handshake_parms *parms)
 	}
 	tlshd_log_debug("System trust: Loaded %d certificate(s).", ret);
 
-	flags = GNUTLS_CLIENT;
+	flags = tlshd_client_init_flags(parms);
 	ret = gnutls_init(&session, flags);
 	if (ret != GNUTLS_E_SUCCESS) {
 		tlshd_log_gnutls_error(ret);
@@ -102,28 +113,41 @@ out_free_creds:
 	gnutls_certificate_free_credentials(xcred);
 }
 
-static gnutls_privkey_t tlshd_privkey;
-static gnutls_pcert_st tlshd_cert;
+static gnutls_privkey_t tlshd_privkeys[TLSHD_MAX_IDENTITIES];
+static gnutls_pcert_st tlshd_certs[TLSHD_MAX_IDENTITIES];
+static unsigned int tlshd_identities;
 
 /*
- * XXX: After this point, tlshd_cert should be deinited on error.
+ * XXX: After this point, tlshd_certs should be deinited on error.
  */
 static bool tlshd_x509_client_get_cert(struct tlshd_handshake_parms *parms)
 {
-	if (parms->x509_cert != TLS_NO_CERT)
-		return tlshd_keyring_get_cert(parms->x509_cert, &tlshd_cert);
-	return tlshd_config_get_client_cert(&tlshd_cert);
+	if (parms->x509_cert != TLS_NO_CERT) {
+		tlshd_identities = 1;
+		return tlshd_keyring_get_cert(parms->x509_cert, &tlshd_certs[0]);
+	}
+	tlshd_identities = TLSHD_MAX_IDENTITIES;
+	return tlshd_config_get_client_certs(tlshd_certs, &tlshd_identities);
 }
 
 /*
- * XXX: After this point, tlshd_privkey should be deinited on error.
+ * XXX: After this point, tlshd_privkeys should be deinited on error.
  */
 static bool tlshd_x509_client_get_privkey(struct tlshd_handshake_parms *parms)
 {
+	unsigned int count = TLSHD_MAX_IDENTITIES;
+
 	if (parms->x509_privkey != TLS_NO_PRIVKEY)
 		return tlshd_keyring_get_privkey(parms->x509_privkey,
-						 tlshd_privkey);
-	return tlshd_config_get_client_privkey(&tlshd_privkey);
+						 tlshd_privkeys[0]);
+	if (!tlshd_config_get_client_privkeys(tlshd_privkeys, &count))
+		return false;
+	if (count != tlshd_identities) {
+		tlshd_log_error("Found %u certificates but %u private keys",
+				tlshd_identities, count);
+		return false;
+	}
+	return true;
 }
 
 static void tlshd_x509_log_issuers(const gnutls_datum_t *req_ca_rdn, int nreqs)
@@ -162,13 +186,14 @@ static void tlshd_x509_log_issuers(const gnutls_datum_t *req_ca_rdn, int nreqs)
 static int
 tlshd_x509_retrieve_key_cb(gnutls_session_t session,
 			   const gnutls_datum_t *req_ca_rdn, int nreqs,
-			   __attribute__ ((unused)) const gnutls_pk_algorithm_t *pk_algos,
-			   __attribute__ ((unused)) int pk_algos_length,
+			   const gnutls_pk_algorithm_t *pk_algos,
+			   int pk_algos_length,
 			   gnutls_pcert_st **pcert,
 			   unsigned int *pcert_length,
 			   gnutls_privkey_t *privkey)
 {
 	gnutls_certificate_type_t type;
+	unsigned int i;
 
 	tlshd_x509_log_issuers(req_ca_rdn, nreqs);
 
@@ -176,9 +201,11 @@ tlshd_x509_retrieve_key_cb(gnutls_session_t session,
 	if (type != GNUTLS_CRT_X509)
 		return -1;
 
+	i = tlshd_x509_select_identity(tlshd_certs, tlshd_identities,
+				       pk_algos, pk_algos_length);
 	*pcert_length = 1;
-	*pcert = &tlshd_cert;
-	*privkey = tlshd_privkey;
+	*pcert = &tlshd_certs[i];
+	*privkey = tlshd_privkeys[i];
 	return 0;
 }
 
@@ -192,8 +219,7 @@ tlshd_x509_retrieve_key_cb(gnutls_session_t session,
  */
 static int tlshd_client_x509_verify_function(gnutls_session_t session)
 {
-	const gnutls_datum_t *peercerts;
-	unsigned int i, status;
+	unsigned int status;
 	const char *hostname;
 	gnutls_datum_t out;
 	int type, ret;
@@ -218,26 +244,11 @@ static int tlshd_client_x509_verify_function(gnutls_session_t session)
 	 * to get picky. Kernel would have to tell us what to look for
 	 * via a netlink attribute. */
 
-	peercerts = gnutls_certificate_get_peers(session,
-						 &tlshd_num_remote_peerids);
-	if (!peercerts || tlshd_num_remote_peerids == 0) {
-		tlshd_log_debug("The peer cert list is empty.\n");
+	if (!tlshd_x509_save_peers(session, hostname,
+				   tlshd_remote_peerid,
+				   ARRAY_SIZE(tlshd_remote_peerid),
+				   &tlshd_num_remote_peerids))
                 return GNUTLS_E_CERTIFICATE_ERROR;
-	}
-
-	tlshd_log_debug("The peer offered %d certificate(s).\n",
-			tlshd_num_remote_peerids);
-
-	if (tlshd_num_remote_peerids > ARRAY_SIZE(tlshd_remote_peerid))
-		tlshd_num_remote_peerids = ARRAY_SIZE(tlshd_remote_peerid);
-	for (i = 0; i < tlshd_num_remote_peerids; i++) {
-		gnutls_x509_crt_t cert;
-
-		gnutls_x509_crt_init(&cert);
-		gnutls_x509_crt_import(cert, &peercerts[i], GNUTLS_X509_FMT_DER);
-		tlshd_remote_peerid[i] = tlshd_keyring_create_cert(cert, hostname);
-		gnutls_x509_crt_deinit(cert);
-	}
 
 	return GNUTLS_E_SUCCESS;
 }
@@ -269,7 +280,7 @@ static void tlshd_client_x509_handshake(struct tlshd_handshake_parms *parms)
 	gnutls_certificate_set_retrieve_function2(xcred,
 						  tlshd_x509_retrieve_key_cb);
 
-	flags = GNUTLS_CLIENT;
+	flags = tlshd_client_init_flags(parms);
 	ret = gnutls_init(&session, flags);
 	if (ret != GNUTLS_E_SUCCESS) {
 		tlshd_log_gnutls_error(ret);
@@ -283,6 +294,7 @@ static void tlshd_client_x509_handshake(struct tlshd_handshake_parms *parms)
 	gnutls_certificate_set_verify_function(xcred,
 					       tlshd_client_x509_verify_function);
 	gnutls_session_set_verify_cert(session, parms->peername, 0);
+	tlshd_set_cert_compression(session, parms);
 
 	tlshd_start_tls_handshake(session, parms);
 
@@ -327,7 +339,7 @@ static void tlshd_client_psk_handshake_one(struct tlshd_handshake_parms *parms,
 		goto out_free_creds;
 	}
 
-	flags = GNUTLS_CLIENT;
+	flags = tlshd_client_init_flags(parms);
 	ret = gnutls_init(&session, flags);
 	if (ret != GNUTLS_E_SUCCESS) {
 		tlshd_log_gnutls_error(ret);
@@ -390,15 +402,22 @@ void tlshd_clienthello_handshake(struct tlshd_handshake_parms *parms)
 		gnutls_global_set_log_level(tlshd_tls_debug);
 	gnutls_global_set_log_function(tlshd_gnutls_log_func);
 	gnutls_global_set_audit_log_function(tlshd_gnutls_audit_func);
+	tlshd_trace_begin();
 
 	tlshd_log_debug("System config file: %s", gnutls_get_system_config_file());
 
+	tlshd_cache_predict_group(parms);
+
 	switch (parms->auth_mode) {
 	case HANDSHAKE_AUTH_UNAUTH:
 		tlshd_client_anon_handshake(parms);
 		break;
 	case HANDSHAKE_AUTH_X509:
-		tlshd_client_x509_handshake(parms);
+		if (tlshd_rawpk_enabled(parms))
+			tlshd_rawpk_handshake(parms,
+					      tlshd_client_init_flags(parms));
+		else
+			tlshd_client_x509_handshake(parms);
 		break;
 	case HANDSHAKE_AUTH_PSK:
 		tlshd_client_psk_handshake(parms);
@@ -43,6 +43,7 @@
 #include <glib.h>
 
 #include "tlshd.h"
+#include "netlink.h"
 
 static GKeyFile *tlshd_configuration;
 
@@ -165,76 +166,229 @@ out:
 	return ret;
 }
 
-/**
- * tlshd_config_get_client_cert - Get cert for ClientHello from .conf
- * @cert: OUT: in-memory certificate
- *
- * Return values:
- *   %true: certificate retrieved successfully
- *   %false: certificate not retrieved
+/*
+ * Load each certificate listed in @section's "x509.certificate".
+ * On success, @count is set to the number of certificates loaded.
  */
-bool tlshd_config_get_client_cert(gnutls_pcert_st *cert)
+static bool tlshd_config_get_certs(const char *section,
+				   gnutls_pcert_st *certs,
+				   unsigned int *count)
 {
 	GError *error = NULL;
 	gnutls_datum_t data;
-	gchar *pathname;
+	gchar **pathnames;
+	unsigned int i;
+	gsize length;
 	int ret;
 
-	pathname = g_key_file_get_string(tlshd_configuration, "authenticate.client",
-					"x509.certificate", &error);
-	if (!pathname) {
+	pathnames = g_key_file_get_string_list(tlshd_configuration, section,
+					       "x509.certificate", &length,
+					       &error);
+	if (!pathnames) {
 		tlshd_log_gerror("Default certificate not found", error);
 		g_error_free(error);
 		return false;
 	}
+	if (length > *count) {
+		tlshd_log_error("Only the first %u certificates are used",
+				*count);
+		length = *count;
+	}
 
-	if (!tlshd_config_read_datum(pathname, &data))
-		return false;
+	for (i = 0; i < length; i++) {
+		if (!tlshd_config_read_datum(g_strstrip(pathnames[i]), &data))
+			goto out_deinit;
 
-	/* Config file supports only PEM-encoded certificates */
-	ret = gnutls_pcert_import_x509_raw(cert, &data,
-					   GNUTLS_X509_FMT_PEM, 0);
-	free(data.data);
-	if (ret != GNUTLS_E_SUCCESS) {
-		tlshd_log_gnutls_error(ret);
+		/* Config file supports only PEM-encoded certificates */
+		ret = gnutls_pcert_import_x509_raw(&certs[i], &data,
+						   GNUTLS_X509_FMT_PEM, 0);
+		free(data.data);
+		if (ret != GNUTLS_E_SUCCESS) {
+			tlshd_log_gnutls_error(ret);
+			goto out_deinit;
+		}
+
+		tlshd_log_debug("Retrieved x.509 certificate from %s",
+				pathnames[i]);
+	}
+	g_strfreev(pathnames);
+	*count = length;
+	return true;
+
+out_deinit:
+	while (i--)
+		gnutls_pcert_deinit(&certs[i]);
+	g_strfreev(pathnames);
+	return false;
+}
+
+/*
+ * Load each private key listed in @section's "x509.private_key".
+ * On success, @count is set to the number of keys loaded.
+ */
+static bool tlshd_config_get_privkeys(const char *section,
+				      gnutls_privkey_t *privkeys,
+				      unsigned int *count)
+{
+	GError *error = NULL;
+	gnutls_datum_t data;
+	gchar **pathnames;
+	unsigned int i;
+	gsize length;
+	int ret;
+
+	pathnames = g_key_file_get_string_list(tlshd_configuration, section,
+					       "x509.private_key", &length,
+					       &error);
+	if (!pathnames) {
+		tlshd_log_gerror("Default private key not found", error);
+		g_error_free(error);
 		return false;
 	}
+	if (length > *count)
+		length = *count;
+
+	for (i = 0; i < length; i++) {
+		if (!tlshd_config_read_datum(g_strstrip(pathnames[i]), &data))
+			goto out_deinit;
+
+		ret = gnutls_privkey_init(&privkeys[i]);
+		if (ret != GNUTLS_E_SUCCESS) {
+			tlshd_log_gnutls_error(ret);
+			free(data.data);
+			goto out_deinit;
+		}
 
-	tlshd_log_debug("Retrieved x.509 certificate from %s", pathname);
+		/* Config file supports only PEM-encoded keys */
+		ret = gnutls_privkey_import_x509_raw(privkeys[i], &data,
+						     GNUTLS_X509_FMT_PEM,
+						     NULL, 0);
+		free(data.data);
+		if (ret != GNUTLS_E_SUCCESS) {
+			tlshd_log_gnutls_error(ret);
+			gnutls_privkey_deinit(privkeys[i]);
+			goto out_deinit;
+		}
+
+		tlshd_log_debug("Retrieved private key from %s",
+				pathnames[i]);
+	}
+	g_strfreev(pathnames);
+	*count = length;
 	return true;
+
+out_deinit:
+	while (i--)
+		gnutls_privkey_deinit(privkeys[i]);
+	g_strfreev(pathnames);
+	return false;
+}
+
+/**
+ * tlshd_config_get_client_certs - Get certs for ClientHello from .conf
+ * @certs: OUT: in-memory certificates
+ * @count: IN: size of @certs; OUT: number of certificates retrieved
+ *
+ * Return values:
+ *   %true: certificates retrieved successfully
+ *   %false: certificates not retrieved
+ */
+bool tlshd_config_get_client_certs(gnutls_pcert_st *certs,
+				   unsigned int *count)
+{
+	return tlshd_config_get_certs("authenticate.client", certs, count);
+}
+
+/**
+ * tlshd_config_get_client_privkeys - Get private keys for ClientHello from .conf
+ * @privkeys: OUT: in-memory private keys
+ * @count: IN: size of @privkeys; OUT: number of keys retrieved
+ *
+ * Return values:
+ *   %true: private keys retrieved successfully
+ *   %false: private keys not retrieved
+ */
+bool tlshd_config_get_client_privkeys(gnutls_privkey_t *privkeys,
+				      unsigned int *count)
+{
+	return tlshd_config_get_privkeys("authenticate.client", privkeys,
+					 count);
+}
+
+/**
+ * tlshd_config_get_server_certs - Get certs for ServerHello from .conf
+ * @certs: OUT: in-memory certificates
+ * @count: IN: size of @certs; OUT: number of certificates retrieved
+ *
+ * Return values:
+ *   %true: certificates retrieved successfully
+ *   %false: certificates not retrieved
+ */
+bool tlshd_config_get_server_certs(gnutls_pcert_st *certs,
+				   unsigned int *count)
+{
+	return tlshd_config_get_certs("authenticate.server", certs, count);
+}
+
+/**
+ * tlshd_config_get_server_privkeys - Get private keys for ServerHello from .conf
+ * @privkeys: OUT: in-memory private keys
+ * @count: IN: size of @privkeys; OUT: number of keys retrieved
+ *
+ * Return values:
+ *   %true: private keys retrieved successfully
+ *   %false: private keys not retrieved
+ */
+bool tlshd_config_get_server_privkeys(gnutls_privkey_t *privkeys,
+				      unsigned int *count)
+{
+	return tlshd_config_get_privkeys("authenticate.server", privkeys,
+					 count);
+}
+
+static const char *tlshd_config_auth_section(int handshake_type)
+{
+	if (handshake_type == HANDSHAKE_MSG_TYPE_SERVERHELLO)
+		return "authenticate.server";
+	return "authenticate.client";
 }
 
 /**
- * tlshd_config_get_client_privkey - Get private key for ClientHello from .conf
+ * tlshd_config_get_rawpk_privkey - Get private key for raw public key mode
+ * @handshake_type: HANDSHAKE_MSG_TYPE_CLIENTHELLO or _SERVERHELLO
  * @privkey: OUT: in-memory private key
  *
  * Return values:
  *   %true: private key retrieved successfully
  *   %false: private key not retrieved
  */
-bool tlshd_config_get_client_privkey(gnutls_privkey_t *privkey)
+bool tlshd_config_get_rawpk_privkey(int handshake_type,
+				    gnutls_privkey_t *privkey)
 {
 	GError *error = NULL;
 	gnutls_datum_t data;
 	gchar *pathname;
+	bool result = false;
 	int ret;
 
-	pathname = g_key_file_get_string(tlshd_configuration, "authenticate.client",
-					"x509.private_key", &error);
+	pathname = g_key_file_get_string(tlshd_configuration,
+					 tlshd_config_auth_section(handshake_type),
+					 "rawpk.private_key", &error);
 	if (!pathname) {
-		tlshd_log_gerror("Default private key not found", error);
+		tlshd_log_gerror("Raw public key mode private key not found",
+				 error);
 		g_error_free(error);
 		return false;
 	}
 
 	if (!tlshd_config_read_datum(pathname, &data))
-		return false;
+		goto out;
 
 	ret = gnutls_privkey_init(privkey);
 	if (ret != GNUTLS_E_SUCCESS) {
 		tlshd_log_gnutls_error(ret);
 		free(data.data);
-		return false;
+		goto out;
 	}
 
 	/* Config file supports only PEM-encoded keys */
@@ -243,94 +397,425 @@ bool tlshd_config_get_client_privkey(gnutls_privkey_t *privkey)
 	free(data.data);
 	if (ret != GNUTLS_E_SUCCESS) {
 		tlshd_log_gnutls_error(ret);
-		return false;
+		gnutls_privkey_deinit(*privkey);
+		goto out;
 	}
 
 	tlshd_log_debug("Retrieved private key from %s", pathname);
-	return true;
+	result = true;
+
+out:
+	g_free(pathname);
+	return result;
 }
 
 /**
- * tlshd_config_get_server_cert - Get cert for ServerHello from .conf
- * @cert: OUT: in-memory certificate
+ * tlshd_config_get_rawpk_pins - Get the pinned raw public keys file
+ * @handshake_type: HANDSHAKE_MSG_TYPE_CLIENTHELLO or _SERVERHELLO
+ * @data: OUT: contents of the file
+ *
+ * On success, caller must release @data->data by calling free(3).
  *
  * Return values:
- *   %true: certificate retrieved successfully
- *   %false: certificate not retrieved
+ *   %true: @data has been initialized
+ *   %false: Raw public key mode is not configured
  */
-bool tlshd_config_get_server_cert(gnutls_pcert_st *cert)
+bool tlshd_config_get_rawpk_pins(int handshake_type, gnutls_datum_t *data)
 {
-	GError *error = NULL;
-	gnutls_datum_t data;
 	gchar *pathname;
-	int ret;
+	bool ret;
 
-	pathname = g_key_file_get_string(tlshd_configuration, "authenticate.server",
-					"x509.certificate", &error);
-	if (!pathname) {
-		tlshd_log_gerror("Default certificate not found", error);
-		g_error_free(error);
+	pathname = g_key_file_get_string(tlshd_configuration,
+					 tlshd_config_auth_section(handshake_type),
+					 "rawpk.pinned_keys", NULL);
+	if (!pathname)
 		return false;
-	}
 
-	if (!tlshd_config_read_datum(pathname, &data))
-		return false;
+	ret = tlshd_config_read_datum(pathname, data);
+	if (ret)
+		tlshd_log_debug("Retrieved pinned public keys from %s",
+				pathname);
+	g_free(pathname);
+	return ret;
+}
 
-	/* Config file supports only PEM-encoded certificates */
-	ret = gnutls_pcert_import_x509_raw(cert, &data,
-					   GNUTLS_X509_FMT_PEM, 0);
-	free(data.data);
-	if (ret != GNUTLS_E_SUCCESS) {
-		tlshd_log_gnutls_error(ret);
+/**
+ * tlshd_config_get_session_tickets - Get server session ticket settings
+ * @lifetime: OUT: ticket lifetime, in seconds
+ *
+ * Return values:
+ *   %true: Server-side session tickets are enabled
+ *   %false: Server-side session tickets are disabled
+ */
+bool tlshd_config_get_session_tickets(unsigned int *lifetime)
+{
+	gint seconds;
+
+	if (!g_key_file_get_boolean(tlshd_configuration, "authenticate.server",
+				    "session_tickets", NULL))
 		return false;
+
+	seconds = g_key_file_get_integer(tlshd_configuration,
+					 "authenticate.server",
+					 "ticket_lifetime", NULL);
+	*lifetime = seconds > 0 ? seconds : TLSHD_DEFAULT_TICKET_LIFETIME;
+	return true;
+}
+
+/**
+ * tlshd_config_get_key_share_prediction - Get key share prediction setting
+ *
+ * Return values:
+ *   %true: Offer only the key share a server selected previously
+ *   %false: Offer the library's default key shares
+ */
+bool tlshd_config_get_key_share_prediction(void)
+{
+	return g_key_file_get_boolean(tlshd_configuration, "authenticate.client",
+				      "predict_key_share", NULL);
+}
+
+#ifdef HAVE_GNUTLS_COMPRESS_CERTIFICATE_SET_METHODS
+static const struct {
+	const char			*name;
+	gnutls_compression_method_t	method;
+} tlshd_cert_compression_names[] = {
+	{ "zlib",	GNUTLS_COMP_ZLIB },
+	{ "brotli",	GNUTLS_COMP_BROTLI },
+	{ "zstd",	GNUTLS_COMP_ZSTD },
+};
+
+/**
+ * tlshd_config_get_cert_compression - Get certificate compression methods
+ * @handshake_type: HANDSHAKE_MSG_TYPE_CLIENTHELLO or _SERVERHELLO
+ * @methods: OUT: compression methods, in order of preference
+ * @count: IN: size of @methods; OUT: number of entries filled in
+ *
+ * Unrecognized method names are ignored.
+ */
+void tlshd_config_get_cert_compression(int handshake_type,
+				       gnutls_compression_method_t *methods,
+				       size_t *count)
+{
+	const char *section = "authenticate.client";
+	gsize i, j, length;
+	gchar **names;
+	size_t n = 0;
+
+	if (handshake_type == HANDSHAKE_MSG_TYPE_SERVERHELLO)
+		section = "authenticate.server";
+	names = g_key_file_get_string_list(tlshd_configuration, section,
+					   "certificate_compression",
+					   &length, NULL);
+	if (!names) {
+		*count = 0;
+		return;
+	}
+
+	for (i = 0; i < length && n < *count; i++) {
+		const gchar *name = g_strstrip(names[i]);
+
+		for (j = 0; j < ARRAY_SIZE(tlshd_cert_compression_names); j++)
+			if (!strcasecmp(name, tlshd_cert_compression_names[j].name))
+				break;
+		if (j == ARRAY_SIZE(tlshd_cert_compression_names)) {
+			tlshd_log_error("Unrecognized certificate compression method: %s",
+					name);
+			continue;
+		}
+		methods[n++] = tlshd_cert_compression_names[j].method;
+	}
+	g_strfreev(names);
+	*count = n;
+}
+#endif /* HAVE_GNUTLS_COMPRESS_CERTIFICATE_SET_METHODS */
+
+/**
+ * tlshd_config_get_tune_handshake - Get handshake TCP tuning setting
+ *
+ * Return values:
+ *   %true: Adjust TCP options for low latency during handshakes
+ *   %false: Leave the consumer's TCP options alone
+ */
+bool tlshd_config_get_tune_handshake(void)
+{
+	if (!g_key_file_has_key(tlshd_configuration, "main",
+				"tune_handshake", NULL))
+		return true;
+	return g_key_file_get_boolean(tlshd_configuration, "main",
+				      "tune_handshake", NULL);
+}
+
+/**
+ * tlshd_config_get_log_handshake_cost - Get per-handshake cost logging setting
+ *
+ * Return values:
+ *   %true: Log the CPU and memory used by each handshake
+ *   %false: Do not log handshake costs
+ */
+bool tlshd_config_get_log_handshake_cost(void)
+{
+	return g_key_file_get_boolean(tlshd_configuration, "main",
+				      "log_handshake_cost", NULL);
+}
+
+/**
+ * tlshd_config_get_metrics_socket - Get pathname of the metrics socket
+ *
+ * Caller must release the returned string with g_free().
+ *
+ * Returns NULL if no metrics socket is configured.
+ */
+gchar *tlshd_config_get_metrics_socket(void)
+{
+	return g_key_file_get_string(tlshd_configuration, "main",
+				     "metrics_socket", NULL);
+}
+
+/**
+ * tlshd_config_get_log_rate_limit - Get failure log rate limit settings
+ * @rate: OUT: failure messages per second allowed in each class
+ * @burst: OUT: failure messages allowed in a burst
+ *
+ * Return values:
+ *   %true: Failure messages are rate limited
+ *   %false: "log_rate_limit" is zero, so failures are always logged
+ */
+bool tlshd_config_get_log_rate_limit(unsigned int *rate, unsigned int *burst)
+{
+	gint value;
+
+	*rate = TLSHD_DEFAULT_LOG_RATE_LIMIT;
+	if (g_key_file_has_key(tlshd_configuration, "main", "log_rate_limit",
+			       NULL)) {
+		value = g_key_file_get_integer(tlshd_configuration, "main",
+					       "log_rate_limit", NULL);
+		if (value <= 0)
+			return false;
+		*rate = value;
 	}
 
-	tlshd_log_debug("Retrieved x.509 certificate from %s", pathname);
+	value = g_key_file_get_integer(tlshd_configuration, "main",
+				       "log_rate_burst", NULL);
+	*burst = value > 0 ? value : TLSHD_DEFAULT_LOG_RATE_BURST;
 	return true;
 }
 
 /**
- * tlshd_config_get_server_privkey - Get private key for ServerHello from .conf
- * @privkey: OUT: in-memory private key
+ * tlshd_config_get_tls_trace - Get GnuTLS trace capture settings
+ * @level: OUT: GnuTLS log level to capture at
+ * @threshold_ms: OUT: log traces of handshakes that take this long
+ *
+ * A @threshold_ms of zero means only traces of failed handshakes
+ * are logged.
  *
  * Return values:
- *   %true: private key retrieved successfully
- *   %false: private key not retrieved
+ *   %true: Capture a GnuTLS trace of each handshake
+ *   %false: "tls_trace" is zero or absent
  */
-bool tlshd_config_get_server_privkey(gnutls_privkey_t *privkey)
+bool tlshd_config_get_tls_trace(int *level, unsigned int *threshold_ms)
+{
+	gint value;
+
+	*level = g_key_file_get_integer(tlshd_configuration, "main",
+					"tls_trace", NULL);
+	if (*level <= 0)
+		return false;
+
+	value = g_key_file_get_integer(tlshd_configuration, "main",
+				       "tls_trace_threshold", NULL);
+	*threshold_ms = value > 0 ? value : 0;
+	return true;
+}
+
+/**
+ * tlshd_config_get_handshake_events - Get pathname of the event file
+ *
+ * Caller must release the returned string with g_free().
+ *
+ * Returns NULL if no handshake event file is configured.
+ */
+gchar *tlshd_config_get_handshake_events(void)
+{
+	return g_key_file_get_string(tlshd_configuration, "main",
+				     "handshake_events", NULL);
+}
+
+/**
+ * tlshd_config_get_control_socket - Get pathname of the control socket
+ *
+ * Caller must release the returned string with g_free().
+ *
+ * Returns NULL if no control socket is configured.
+ */
+gchar *tlshd_config_get_control_socket(void)
+{
+	return g_key_file_get_string(tlshd_configuration, "main",
+				     "control_socket", NULL);
+}
+
+/**
+ * tlshd_config_get_ticket_key - Get session ticket master key from .conf
+ * @key: OUT: in-memory ticket master key
+ *
+ * If no key file is specified, @key->data is set to NULL and the
+ * caller is expected to generate a key.
+ *
+ * On success, caller must release @key->data by calling gnutls_free(3).
+ *
+ * Return values:
+ *   %true: @key has been initialized
+ *   %false: A key file is specified but could not be used
+ */
+bool tlshd_config_get_ticket_key(gnutls_datum_t *key)
 {
-	GError *error = NULL;
 	gnutls_datum_t data;
 	gchar *pathname;
-	int ret;
 
-	pathname = g_key_file_get_string(tlshd_configuration, "authenticate.server",
-					"x509.private_key", &error);
-	if (!pathname) {
-		tlshd_log_gerror("Default private key not found", error);
-		g_error_free(error);
-		return false;
-	}
+	key->data = NULL;
+	key->size = 0;
 
-	if (!tlshd_config_read_datum(pathname, &data))
-		return false;
+	pathname = g_key_file_get_string(tlshd_configuration,
+					 "authenticate.server",
+					 "ticket_key", NULL);
+	if (!pathname)
+		return true;
 
-	ret = gnutls_privkey_init(privkey);
-	if (ret != GNUTLS_E_SUCCESS) {
-		tlshd_log_gnutls_error(ret);
+	if (!tlshd_config_read_datum(pathname, &data)) {
+		g_free(pathname);
+		return false;
+	}
+	if (data.size != TLSHD_TICKET_KEY_SIZE) {
+		tlshd_log_error("Ticket key file %s must contain exactly %u bytes",
+				pathname, TLSHD_TICKET_KEY_SIZE);
+		gnutls_memset(data.data, 0, data.size);
 		free(data.data);
+		g_free(pathname);
 		return false;
 	}
 
-	/* Config file supports only PEM-encoded keys */
-	ret = gnutls_privkey_import_x509_raw(*privkey, &data,
-					     GNUTLS_X509_FMT_PEM, NULL, 0);
+	key->data = gnutls_malloc(data.size);
+	if (key->data) {
+		memcpy(key->data, data.data, data.size);
+		key->size = data.size;
+	}
+	gnutls_memset(data.data, 0, data.size);
 	free(data.data);
-	if (ret != GNUTLS_E_SUCCESS) {
-		tlshd_log_gnutls_error(ret);
+	if (!key->data) {
+		tlshd_log_error("Failed to allocate ticket key buffer.");
+		g_free(pathname);
 		return false;
 	}
 
-	tlshd_log_debug("Retrieved private key from %s", pathname);
+	tlshd_log_debug("Retrieved session ticket key from %s", pathname);
+	g_free(pathname);
 	return true;
 }
+
+/**
+ * tlshd_config_get_ktls_ciphers - Get pinned kTLS cipher order from .conf
+ * @length: OUT: number of entries in the returned list
+ *
+ * Returns a NULL-terminated list of cipher names that must be freed
+ * with g_strfreev(), or NULL if no cipher order is specified.
+ */
+gchar **tlshd_config_get_ktls_ciphers(gsize *length)
+{
+	return g_key_file_get_string_list(tlshd_configuration, "ktls",
+					  "ciphers", length, NULL);
+}
+
+/**
+ * tlshd_config_get_ktls_benchmark - Get cipher benchmark setting from .conf
+ *
+ * Return values:
+ *   %true: Order ciphers by measured kTLS throughput
+ *   %false: Order ciphers by strength
+ */
+bool tlshd_config_get_ktls_benchmark(void)
+{
+	return g_key_file_get_boolean(tlshd_configuration, "ktls",
+				      "benchmark", NULL);
+}
+
+static const char *tlshd_config_ktls_section(int auth_mode)
+{
+	switch (auth_mode) {
+	case HANDSHAKE_AUTH_UNAUTH:
+		return "ktls.unauth";
+	case HANDSHAKE_AUTH_PSK:
+		return "ktls.psk";
+	case HANDSHAKE_AUTH_X509:
+		return "ktls.x509";
+	}
+	return NULL;
+}
+
+/**
+ * tlshd_config_get_ktls_bool - Get a boolean kTLS socket policy from .conf
+ * @auth_mode: authentication mode of the handshake
+ * @key: name of the setting
+ *
+ * A setting in the [ktls.<auth mode>] section overrides the same
+ * setting in the [ktls] section.
+ *
+ * Return values:
+ *   %true: The policy is enabled for @auth_mode
+ *   %false: The policy is disabled or not specified
+ */
+bool tlshd_config_get_ktls_bool(int auth_mode, const char *key)
+{
+	const char *section = tlshd_config_ktls_section(auth_mode);
+
+	if (section && g_key_file_has_key(tlshd_configuration, section,
+					  key, NULL))
+		return g_key_file_get_boolean(tlshd_configuration, section,
+					      key, NULL);
+	return g_key_file_get_boolean(tlshd_configuration, "ktls", key, NULL);
+}
+
+/**
+ * tlshd_config_get_ktls_list - Get a kTLS socket policy list from .conf
+ * @auth_mode: authentication mode of the handshake
+ * @key: name of the setting
+ * @length: OUT: number of entries in the returned list
+ *
+ * A setting in the [ktls.<auth mode>] section overrides the same
+ * setting in the [ktls] section.
+ *
+ * Returns a NULL-terminated list that must be freed with
+ * g_strfreev(), or NULL if the setting is not specified.
+ */
+gchar **tlshd_config_get_ktls_list(int auth_mode, const char *key,
+				   gsize *length)
+{
+	const char *section = tlshd_config_ktls_section(auth_mode);
+
+	if (section && g_key_file_has_key(tlshd_configuration, section,
+					  key, NULL))
+		return g_key_file_get_string_list(tlshd_configuration, section,
+						  key, length, NULL);
+	return g_key_file_get_string_list(tlshd_configuration, "ktls", key,
+					  length, NULL);
+}
+
+/**
+ * tlshd_config_get_ktls_uint64 - Get a numeric kTLS socket policy from .conf
+ * @auth_mode: authentication mode of the handshake
+ * @key: name of the setting
+ *
+ * A setting in the [ktls.<auth mode>] section overrides the same
+ * setting in the [ktls] section.
+ *
+ * Returns the setting's value, or zero if it is not specified.
+ */
+uint64_t tlshd_config_get_ktls_uint64(int auth_mode, const char *key)
+{
+	const char *section = tlshd_config_ktls_section(auth_mode);
+
+	if (section && g_key_file_has_key(tlshd_configuration, section,
+					  key, NULL))
+		return g_key_file_get_uint64(tlshd_configuration, section,
+					     key, NULL);
+	return g_key_file_get_uint64(tlshd_configuration, "ktls", key, NULL);
+}
@@ -0,0 +1,141 @@
+/*
+ * Adjust and inspect a running tlshd.
+ *
+ * Copyright (c) 2023 Oracle and/or its affiliates.
+ *
+ * ktls-utils is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <keyutils.h>
+
+#include <gnutls/gnutls.h>
+#include <gnutls/abstract.h>
+
+#include <netlink/netlink.h>
+
+#include <glib.h>
+
+#include "tlshd.h"
+
+/*
+ * Commands arrive on the control socket, one per connection, and are
+ * executed on the listener thread in the parent. A changed debug
+ * level is seen by the parent at once, and by each handshake child
+ * forked after the change.
+ */
+
+static const char *tlshd_control_usage =
+	"Commands:\n"
+	"  levels              show debug levels\n"
+	"  debug <level>       set the tlshd debug level\n"
+	"  tlsdebug <level>    set the TLS library debug level\n"
+	"  nl_debug <level>    set the netlink debug level\n"
+	"  inflight            list handshake requests being serviced\n"
+	"  cache               show cached key share groups\n"
+	"  cache flush         forget cached key share groups\n"
+	"  tickets             show server session ticket settings\n"
+	"  stats               show statistics\n";
+
+static bool tlshd_control_set_level(int *level, const char *name,
+				    const char *arg, FILE *out)
+{
+	char *end;
+	long value;
+
+	if (!arg) {
+		fprintf(out, "%s %d\n", name, __atomic_load_n(level, __ATOMIC_RELAXED));
+		return true;
+	}
+	value = strtol(arg, &end, 10);
+	if (*end != '\0' || value < 0 || value > 99) {
+		fprintf(out, "Invalid %s level: %s\n", name, arg);
+		return false;
+	}
+	__atomic_store_n(level, (int)value, __ATOMIC_RELAXED);
+	fprintf(out, "%s %ld\n", name, value);
+	return true;
+}
+
+/**
+ * tlshd_control_execute - Carry out one control command
+ * @request: NUL-terminated command line
+ * @out: stream to write the response to
+ *
+ * Return values:
+ *   %true: The command succeeded
+ *   %false: The command was not recognized or could not be carried out
+ */
+bool tlshd_control_execute(char *request, FILE *out)
+{
+	char *save, *cmd, *arg;
+
+	cmd = strtok_r(request, " \t\r\n", &save);
+	arg = cmd ? strtok_r(NULL, " \t\r\n", &save) : NULL;
+	if (!cmd || !strcmp(cmd, "help")) {
+		fputs(tlshd_control_usage, out);
+		return cmd != NULL;
+	}
+
+	if (!strcmp(cmd, "levels")) {
+		fprintf(out, "debug %d\ntlsdebug %d\nnl_debug %d\n",
+			__atomic_load_n(&tlshd_debug, __ATOMIC_RELAXED),
+			__atomic_load_n(&tlshd_tls_debug, __ATOMIC_RELAXED),
+			__atomic_load_n(&nl_debug, __ATOMIC_RELAXED));
+		return true;
+	}
+	if (!strcmp(cmd, "debug"))
+		return tlshd_control_set_level(&tlshd_debug, cmd, arg, out);
+	if (!strcmp(cmd, "tlsdebug"))
+		return tlshd_control_set_level(&tlshd_tls_debug, cmd, arg, out);
+	if (!strcmp(cmd, "nl_debug"))
+		return tlshd_control_set_level(&nl_debug, cmd, arg, out);
+
+	if (!strcmp(cmd, "inflight")) {
+		tlshd_latency_write_in_flight(out);
+		return true;
+	}
+	if (!strcmp(cmd, "cache")) {
+		if (!arg) {
+			tlshd_cache_write_status(out);
+			return true;
+		}
+		if (!strcmp(arg, "flush")) {
+			fprintf(out, "Removed %u cache entries\n",
+				tlshd_cache_flush());
+			return true;
+		}
+	}
+	if (!strcmp(cmd, "tickets")) {
+		tlshd_ticket_write_status(out);
+		return true;
+	}
+	if (!strcmp(cmd, "stats")) {
+		tlshd_stats_write_metrics(out);
+		return true;
+	}
+
+	fprintf(out, "Unrecognized command: %s\n", cmd);
+	fputs(tlshd_control_usage, out);
+	return false;
+}
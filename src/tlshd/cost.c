@@ -0,0 +1,343 @@
+/*
+ * Account for the CPU and memory each handshake consumes.
+ *
+ * Copyright (c) 2023 Oracle and/or its affiliates.
+ *
+ * ktls-utils is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <keyutils.h>
+
+#include <gnutls/gnutls.h>
+#include <gnutls/abstract.h>
+
+#include <glib.h>
+
+#include "tlshd.h"
+#include "netlink.h"
+
+#define TLSHD_COST_AUTH_MODES	(HANDSHAKE_AUTH_X509 + 1)
+
+/* Indexed by gnutls_cipher_algorithm_t; zero collects the rest */
+#define TLSHD_COST_CIPHERS	(64)
+
+/*
+ * Running totals for one combination of authentication mode and
+ * negotiated cipher. Times are in microseconds. "gnutls" is the
+ * time spent inside gnutls_handshake(); "overhead" is the rest of
+ * the handshake child's life up to the DONE reply.
+ */
+struct tlshd_cost_totals {
+	uint64_t		handshakes;
+	uint64_t		gnutls_user_us;
+	uint64_t		gnutls_sys_us;
+	uint64_t		overhead_user_us;
+	uint64_t		overhead_sys_us;
+	uint64_t		maxrss_growth_kb;
+	uint64_t		io_calls;
+	uint64_t		context_switches;
+};
+
+/*
+ * Like the counters in stats.c, the totals live in an anonymous
+ * shared mapping that the parent creates before forking children.
+ */
+struct tlshd_cost {
+	struct tlshd_cost_totals	totals[TLSHD_COST_AUTH_MODES]
+					      [TLSHD_COST_CIPHERS];
+};
+
+static struct tlshd_cost *tlshd_cost;
+
+static const char *tlshd_cost_auth_names[TLSHD_COST_AUTH_MODES] = {
+	[HANDSHAKE_AUTH_UNSPEC]		= "unspec",
+	[HANDSHAKE_AUTH_UNAUTH]		= "unauth",
+	[HANDSHAKE_AUTH_PSK]		= "psk",
+	[HANDSHAKE_AUTH_X509]		= "x509",
+};
+
+static const char *tlshd_cost_cipher_name(unsigned int cipher)
+{
+	const char *name = NULL;
+
+	if (cipher)
+		name = gnutls_cipher_get_name(cipher);
+	return name ? name : "none";
+}
+
+/*
+ * Each handshake child is single-threaded and services exactly one
+ * request, so RUSAGE_SELF in the child measures that request alone.
+ * These samples are private to the child.
+ */
+static struct {
+	struct rusage		start;
+	struct rusage		gnutls_start;
+	uint64_t		gnutls_user_us;
+	uint64_t		gnutls_sys_us;
+	uint64_t		io_calls;
+	gnutls_cipher_algorithm_t cipher;
+} tlshd_cost_sample;
+
+static uint64_t tlshd_cost_tv_us(const struct timeval *tv)
+{
+	return (uint64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+static uint64_t tlshd_cost_delta_us(const struct timeval *end,
+				    const struct timeval *start)
+{
+	return tlshd_cost_tv_us(end) - tlshd_cost_tv_us(start);
+}
+
+/**
+ * tlshd_cost_init - Create the shared resource accounting area
+ *
+ */
+void tlshd_cost_init(void)
+{
+	tlshd_cost = mmap(NULL, sizeof(*tlshd_cost), PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (tlshd_cost == MAP_FAILED) {
+		tlshd_log_perror("mmap");
+		tlshd_cost = NULL;
+	}
+}
+
+static void tlshd_cost_report(FILE *f, unsigned int mode, unsigned int cipher,
+			      const struct tlshd_cost_totals *t)
+{
+	fprintf(f, "%s handshakes using %s: %llu, avg gnutls %llu+%llu usec, avg overhead %llu+%llu usec, avg RSS growth %llu KB, avg %llu I/O calls, avg %llu context switches",
+		tlshd_cost_auth_names[mode], tlshd_cost_cipher_name(cipher),
+		(unsigned long long)t->handshakes,
+		(unsigned long long)(t->gnutls_user_us / t->handshakes),
+		(unsigned long long)(t->gnutls_sys_us / t->handshakes),
+		(unsigned long long)(t->overhead_user_us / t->handshakes),
+		(unsigned long long)(t->overhead_sys_us / t->handshakes),
+		(unsigned long long)(t->maxrss_growth_kb / t->handshakes),
+		(unsigned long long)(t->io_calls / t->handshakes),
+		(unsigned long long)(t->context_switches / t->handshakes));
+}
+
+/**
+ * tlshd_cost_shutdown - Report and release the accounting area
+ *
+ */
+void tlshd_cost_shutdown(void)
+{
+	const struct tlshd_cost_totals *t;
+	unsigned int mode, cipher;
+	size_t size;
+	char *buf;
+	FILE *f;
+
+	if (!tlshd_cost)
+		return;
+
+	for (mode = 0; mode < TLSHD_COST_AUTH_MODES; mode++)
+		for (cipher = 0; cipher < TLSHD_COST_CIPHERS; cipher++) {
+			t = &tlshd_cost->totals[mode][cipher];
+			if (!t->handshakes)
+				continue;
+			f = open_memstream(&buf, &size);
+			if (!f)
+				continue;
+			tlshd_cost_report(f, mode, cipher, t);
+			if (!fclose(f))
+				tlshd_log_debug("%s", buf);
+			free(buf);
+		}
+
+	munmap(tlshd_cost, sizeof(*tlshd_cost));
+	tlshd_cost = NULL;
+}
+
+/**
+ * tlshd_cost_begin - Start accounting for a handshake request
+ *
+ */
+void tlshd_cost_begin(void)
+{
+	memset(&tlshd_cost_sample, 0, sizeof(tlshd_cost_sample));
+	getrusage(RUSAGE_SELF, &tlshd_cost_sample.start);
+}
+
+/**
+ * tlshd_cost_count_io - Count a send or receive during a handshake
+ *
+ */
+void tlshd_cost_count_io(void)
+{
+	tlshd_cost_sample.io_calls++;
+}
+
+/**
+ * tlshd_cost_gnutls_begin - Note that gnutls_handshake() is starting
+ *
+ */
+void tlshd_cost_gnutls_begin(void)
+{
+	getrusage(RUSAGE_SELF, &tlshd_cost_sample.gnutls_start);
+}
+
+/**
+ * tlshd_cost_gnutls_end - Note that gnutls_handshake() has returned
+ * @session: session that was negotiated
+ *
+ */
+void tlshd_cost_gnutls_end(gnutls_session_t session)
+{
+	struct rusage now;
+
+	getrusage(RUSAGE_SELF, &now);
+	tlshd_cost_sample.gnutls_user_us +=
+		tlshd_cost_delta_us(&now.ru_utime,
+				    &tlshd_cost_sample.gnutls_start.ru_utime);
+	tlshd_cost_sample.gnutls_sys_us +=
+		tlshd_cost_delta_us(&now.ru_stime,
+				    &tlshd_cost_sample.gnutls_start.ru_stime);
+	tlshd_cost_sample.cipher = gnutls_cipher_get(session);
+}
+
+/**
+ * tlshd_cost_end - Finish accounting for a handshake request
+ * @parms: handshake parameters
+ *
+ */
+void tlshd_cost_end(const struct tlshd_handshake_parms *parms)
+{
+	const struct rusage *start = &tlshd_cost_sample.start;
+	uint64_t user_us, sys_us, growth_kb, switches;
+	struct tlshd_cost_totals *t;
+	unsigned int mode, cipher;
+	struct rusage now;
+
+	getrusage(RUSAGE_SELF, &now);
+	user_us = tlshd_cost_delta_us(&now.ru_utime, &start->ru_utime);
+	sys_us = tlshd_cost_delta_us(&now.ru_stime, &start->ru_stime);
+	growth_kb = now.ru_maxrss > start->ru_maxrss ?
+		now.ru_maxrss - start->ru_maxrss : 0;
+	switches = (now.ru_nvcsw - start->ru_nvcsw) +
+		   (now.ru_nivcsw - start->ru_nivcsw);
+
+	mode = parms->auth_mode;
+	if (mode >= TLSHD_COST_AUTH_MODES)
+		mode = HANDSHAKE_AUTH_UNSPEC;
+	cipher = tlshd_cost_sample.cipher;
+	if (cipher >= TLSHD_COST_CIPHERS)
+		cipher = 0;
+
+	if (tlshd_config_get_log_handshake_cost())
+		tlshd_log_notice("Handshake cost: gnutls %llu+%llu usec, overhead %llu+%llu usec, RSS growth %llu KB, %llu I/O calls, %llu context switches",
+				 (unsigned long long)tlshd_cost_sample.gnutls_user_us,
+				 (unsigned long long)tlshd_cost_sample.gnutls_sys_us,
+				 (unsigned long long)(user_us - tlshd_cost_sample.gnutls_user_us),
+				 (unsigned long long)(sys_us - tlshd_cost_sample.gnutls_sys_us),
+				 (unsigned long long)growth_kb,
+				 (unsigned long long)tlshd_cost_sample.io_calls,
+				 (unsigned long long)switches);
+
+	if (!tlshd_cost)
+		return;
+	t = &tlshd_cost->totals[mode][cipher];
+	__atomic_fetch_add(&t->handshakes, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&t->gnutls_user_us,
+			   tlshd_cost_sample.gnutls_user_us, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&t->gnutls_sys_us,
+			   tlshd_cost_sample.gnutls_sys_us, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&t->overhead_user_us,
+			   user_us - tlshd_cost_sample.gnutls_user_us,
+			   __ATOMIC_RELAXED);
+	__atomic_fetch_add(&t->overhead_sys_us,
+			   sys_us - tlshd_cost_sample.gnutls_sys_us,
+			   __ATOMIC_RELAXED);
+	__atomic_fetch_add(&t->maxrss_growth_kb, growth_kb, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&t->io_calls, tlshd_cost_sample.io_calls,
+			   __ATOMIC_RELAXED);
+	__atomic_fetch_add(&t->context_switches, switches, __ATOMIC_RELAXED);
+}
+
+static void tlshd_cost_write_family(FILE *f, const char *metric,
+				    const char *type, size_t offset,
+				    double scale)
+{
+	const struct tlshd_cost_totals *t;
+	unsigned int mode, cipher;
+	uint64_t value;
+
+	fprintf(f, "# TYPE tlshd_%s %s\n", metric, type);
+	for (mode = 0; mode < TLSHD_COST_AUTH_MODES; mode++)
+		for (cipher = 0; cipher < TLSHD_COST_CIPHERS; cipher++) {
+			t = &tlshd_cost->totals[mode][cipher];
+			if (!__atomic_load_n(&t->handshakes, __ATOMIC_RELAXED))
+				continue;
+			value = __atomic_load_n((const uint64_t *)((const char *)t + offset),
+						__ATOMIC_RELAXED);
+			fprintf(f, "tlshd_%s{auth=\"%s\",cipher=\"%s\"} ",
+				metric, tlshd_cost_auth_names[mode],
+				tlshd_cost_cipher_name(cipher));
+			if (scale != 1)
+				fprintf(f, "%.6f\n", value * scale);
+			else
+				fprintf(f, "%llu\n", (unsigned long long)value);
+		}
+}
+
+/**
+ * tlshd_cost_write_metrics - Emit resource totals in Prometheus format
+ * @f: stream to write to
+ *
+ */
+void tlshd_cost_write_metrics(FILE *f)
+{
+	if (!tlshd_cost)
+		return;
+
+	tlshd_cost_write_family(f, "cost_handshakes_total", "counter",
+				offsetof(struct tlshd_cost_totals, handshakes), 1);
+	tlshd_cost_write_family(f, "cost_gnutls_user_seconds_total", "counter",
+				offsetof(struct tlshd_cost_totals, gnutls_user_us),
+				1e-6);
+	tlshd_cost_write_family(f, "cost_gnutls_system_seconds_total", "counter",
+				offsetof(struct tlshd_cost_totals, gnutls_sys_us),
+				1e-6);
+	tlshd_cost_write_family(f, "cost_overhead_user_seconds_total", "counter",
+				offsetof(struct tlshd_cost_totals, overhead_user_us),
+				1e-6);
+	tlshd_cost_write_family(f, "cost_overhead_system_seconds_total", "counter",
+				offsetof(struct tlshd_cost_totals, overhead_sys_us),
+				1e-6);
+	tlshd_cost_write_family(f, "cost_maxrss_growth_kilobytes_total", "counter",
+				offsetof(struct tlshd_cost_totals, maxrss_growth_kb),
+				1);
+	tlshd_cost_write_family(f, "cost_io_calls_total", "counter",
+				offsetof(struct tlshd_cost_totals, io_calls), 1);
+	tlshd_cost_write_family(f, "cost_context_switches_total", "counter",
+				offsetof(struct tlshd_cost_totals, context_switches),
+				1);
+}
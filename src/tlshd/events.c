@@ -0,0 +1,213 @@
+/*
+ * Record one structured event per handshake.
+ *
+ * Copyright (c) 2023 Oracle and/or its affiliates.
+ *
+ * ktls-utils is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <keyutils.h>
+
+#include <gnutls/gnutls.h>
+#include <gnutls/abstract.h>
+
+#include <glib.h>
+
+#include "tlshd.h"
+#include "netlink.h"
+
+/*
+ * The parent opens the file once, and each handshake child appends
+ * its record with a single write(2). O_APPEND keeps concurrent
+ * records from overwriting one another.
+ */
+static int tlshd_events_fd = -1;
+
+static const char *tlshd_events_auth_names[] = {
+	[HANDSHAKE_AUTH_UNSPEC]		= "unspec",
+	[HANDSHAKE_AUTH_UNAUTH]		= "unauth",
+	[HANDSHAKE_AUTH_PSK]		= "psk",
+	[HANDSHAKE_AUTH_X509]		= "x509",
+};
+
+static const char *tlshd_events_type_names[] = {
+	[HANDSHAKE_MSG_TYPE_UNSPEC]	= "unspec",
+	[HANDSHAKE_MSG_TYPE_CLIENTHELLO] = "client",
+	[HANDSHAKE_MSG_TYPE_SERVERHELLO] = "server",
+};
+
+/**
+ * tlshd_events_init - Open the handshake event file, if configured
+ *
+ */
+void tlshd_events_init(void)
+{
+	gchar *pathname;
+
+	pathname = tlshd_config_get_handshake_events();
+	if (!pathname)
+		return;
+
+	tlshd_events_fd = open(pathname,
+			       O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+			       S_IRUSR | S_IWUSR);
+	if (tlshd_events_fd < 0)
+		tlshd_log_perror("open");
+	else
+		tlshd_log_debug("Recording handshake events in %s", pathname);
+	g_free(pathname);
+}
+
+/**
+ * tlshd_events_shutdown - Close the handshake event file
+ *
+ */
+void tlshd_events_shutdown(void)
+{
+	if (tlshd_events_fd < 0)
+		return;
+	close(tlshd_events_fd);
+	tlshd_events_fd = -1;
+}
+
+/**
+ * tlshd_events_capture - Save what a handshake negotiated
+ * @session: session whose handshake has just succeeded
+ * @parms: handshake parameters
+ *
+ * The names returned by GnuTLS are static, so they remain valid
+ * after @session is released.
+ */
+void tlshd_events_capture(gnutls_session_t session,
+			  struct tlshd_handshake_parms *parms)
+{
+	struct tlshd_session_desc *desc = &parms->negotiated;
+	int sign;
+
+	if (tlshd_events_fd < 0)
+		return;
+
+	desc->version =
+		gnutls_protocol_get_name(gnutls_protocol_get_version(session));
+	desc->cipher = gnutls_cipher_get_name(gnutls_cipher_get(session));
+	desc->group = gnutls_group_get_name(gnutls_group_get(session));
+	sign = gnutls_sign_algorithm_get(session);
+	desc->sigalg = sign < 0 ? NULL : gnutls_sign_get_name(sign);
+	desc->resumed = gnutls_session_is_resumed(session);
+}
+
+static void tlshd_events_string(FILE *f, const char *name, const char *value)
+{
+	const unsigned char *c;
+
+	fprintf(f, ",\"%s\":", name);
+	if (!value) {
+		fputs("null", f);
+		return;
+	}
+
+	fputc('"', f);
+	for (c = (const unsigned char *)value; *c; c++) {
+		if (*c == '"' || *c == '\\')
+			fprintf(f, "\\%c", *c);
+		else if (*c < 0x20)
+			fprintf(f, "\\u%04x", *c);
+		else
+			fputc(*c, f);
+	}
+	fputc('"', f);
+}
+
+static void tlshd_events_timestamp(FILE *f)
+{
+	struct timespec now;
+	char buf[32];
+	struct tm tm;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	gmtime_r(&now.tv_sec, &tm);
+	strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S", &tm);
+	fprintf(f, "{\"time\":\"%s.%06ldZ\"", buf, now.tv_nsec / 1000);
+}
+
+/**
+ * tlshd_events_write - Append a record describing a finished request
+ * @parms: handshake parameters
+ *
+ * Called after the kernel has been told the outcome, so the time it
+ * takes to write the record is not charged to the handshake.
+ */
+void tlshd_events_write(const struct tlshd_handshake_parms *parms)
+{
+	const struct tlshd_session_desc *desc = &parms->negotiated;
+	const char *sep = "";
+	size_t size = 0;
+	char *buf = NULL;
+	unsigned int i;
+	FILE *f;
+
+	if (tlshd_events_fd < 0)
+		return;
+
+	f = open_memstream(&buf, &size);
+	if (!f)
+		return;
+
+	tlshd_events_timestamp(f);
+	fprintf(f, ",\"pid\":%d", (int)getpid());
+	tlshd_events_string(f, "peer_addr", parms->peeraddr_text);
+	tlshd_events_string(f, "peer_name", parms->peername);
+	tlshd_events_string(f, "type", (unsigned int)parms->handshake_type <
+			    ARRAY_SIZE(tlshd_events_type_names) ?
+			    tlshd_events_type_names[parms->handshake_type] :
+			    NULL);
+	tlshd_events_string(f, "auth", (unsigned int)parms->auth_mode <
+			    ARRAY_SIZE(tlshd_events_auth_names) ?
+			    tlshd_events_auth_names[parms->auth_mode] : NULL);
+	tlshd_events_string(f, "version", desc->version);
+	tlshd_events_string(f, "cipher", desc->cipher);
+	tlshd_events_string(f, "group", desc->group);
+	tlshd_events_string(f, "sigalg", desc->sigalg);
+	fprintf(f, ",\"resumed\":%s", desc->resumed ? "true" : "false");
+
+	/* Phases the request did not reach are left out */
+	fputs(",\"phase_usec\":{", f);
+	for (i = 0; i < TLSHD_PHASE_MAX; i++) {
+		if (!parms->phase_durations_ns[i])
+			continue;
+		fprintf(f, "%s\"%s\":%llu", sep, tlshd_latency_phase_name(i),
+			(unsigned long long)(parms->phase_durations_ns[i] / 1000));
+		sep = ",";
+	}
+	fprintf(f, "},\"status\":%u}\n", parms->session_status);
+
+	if (!fclose(f) && write(tlshd_events_fd, buf, size) != (ssize_t)size)
+		tlshd_log_perror("write");
+	free(buf);
+}
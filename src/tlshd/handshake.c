@@ -30,7 +30,11 @@
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <poll.h>
 
+#include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <netdb.h>
 #include <keyutils.h>
@@ -42,6 +46,371 @@
 
 #include "tlshd.h"
 #include "netlink.h"
+#include "probes.h"
+
+#ifdef HAVE_GNUTLS_COMPRESS_CERTIFICATE_SET_METHODS
+/*
+ * A CompressedCertificate message (RFC 8879, Section 4) starts with
+ * a 2-byte algorithm and the 3-byte length of the uncompressed
+ * Certificate message.
+ */
+static void tlshd_count_compressed_cert(unsigned int incoming,
+					const gnutls_datum_t *msg)
+{
+	size_t uncompressed;
+
+	if (!msg || msg->size < 5)
+		return;
+	uncompressed = (msg->data[2] << 16) | (msg->data[3] << 8) |
+			msg->data[4];
+
+	tlshd_stats_inc(incoming ? TLSHD_STAT_CERT_COMPRESSED_RECEIVED :
+				   TLSHD_STAT_CERT_COMPRESSED_SENT);
+	if (uncompressed > msg->size)
+		tlshd_stats_add(TLSHD_STAT_CERT_COMPRESSION_SAVED,
+				uncompressed - msg->size);
+}
+#endif /* HAVE_GNUTLS_COMPRESS_CERTIFICATE_SET_METHODS */
+
+static int tlshd_handshake_hook(__attribute__ ((unused)) gnutls_session_t session,
+				unsigned int htype,
+				__attribute__ ((unused)) unsigned int when,
+				unsigned int incoming,
+				__attribute__ ((unused)) const gnutls_datum_t *msg)
+{
+	tlshd_cache_handshake_hook(htype, incoming);
+#ifdef HAVE_GNUTLS_COMPRESS_CERTIFICATE_SET_METHODS
+	if (htype == GNUTLS_HANDSHAKE_COMPRESSED_CERTIFICATE_PKT)
+		tlshd_count_compressed_cert(incoming, msg);
+#endif
+	return 0;
+}
+
+/*
+ * Relative cost of signing a handshake with @cert's key. Smaller
+ * is cheaper.
+ */
+static unsigned int tlshd_x509_signing_cost(const gnutls_pcert_st *cert)
+{
+	unsigned int bits = 0;
+
+	switch (gnutls_pubkey_get_pk_algorithm(cert->pubkey, &bits)) {
+	case GNUTLS_PK_EDDSA_ED25519:
+		return 1;
+	case GNUTLS_PK_ECDSA:
+		return bits <= 256 ? 2 : 4;
+	case GNUTLS_PK_EDDSA_ED448:
+		return 3;
+	case GNUTLS_PK_RSA:
+	case GNUTLS_PK_RSA_PSS:
+		return 8 + bits / 1024;
+	default:
+		return 64;
+	}
+}
+
+static bool tlshd_x509_pk_offered(const gnutls_pcert_st *cert,
+				  const gnutls_pk_algorithm_t *pk_algos,
+				  int pk_algos_length)
+{
+	gnutls_pk_algorithm_t pk;
+	int i;
+
+	if (!pk_algos || pk_algos_length <= 0)
+		return true;
+
+	pk = gnutls_pubkey_get_pk_algorithm(cert->pubkey, NULL);
+	for (i = 0; i < pk_algos_length; i++) {
+		if (pk_algos[i] == pk)
+			return true;
+		/* An RSA key can also make RSA-PSS signatures */
+		if (pk == GNUTLS_PK_RSA && pk_algos[i] == GNUTLS_PK_RSA_PSS)
+			return true;
+	}
+	return false;
+}
+
+/**
+ * tlshd_x509_select_identity - Choose which x.509 identity to present
+ * @certs: available certificates
+ * @count: number of entries in @certs
+ * @pk_algos: public key algorithms the peer can verify
+ * @pk_algos_length: number of entries in @pk_algos
+ *
+ * Returns the index of the cheapest certificate whose key the peer
+ * accepts, or zero if the peer accepts none of them.
+ */
+unsigned int tlshd_x509_select_identity(const gnutls_pcert_st *certs,
+					unsigned int count,
+					const gnutls_pk_algorithm_t *pk_algos,
+					int pk_algos_length)
+{
+	unsigned int i, cost, best = 0, best_cost = UINT_MAX;
+
+	for (i = 0; i < count; i++) {
+		if (!tlshd_x509_pk_offered(&certs[i], pk_algos,
+					   pk_algos_length))
+			continue;
+		cost = tlshd_x509_signing_cost(&certs[i]);
+		if (cost < best_cost) {
+			best = i;
+			best_cost = cost;
+		}
+	}
+	if (count > 1)
+		tlshd_log_debug("Presenting x.509 identity %u of %u",
+				best + 1, count);
+	return best;
+}
+
+/**
+ * tlshd_x509_save_peers - Record the peer's certificate chain
+ * @session: session in which the peer presented certificates
+ * @hostname: NUL-terminated string naming the peer
+ * @peerids: OUT: key serial numbers of the peer's certificates
+ * @max: number of entries in @peerids
+ * @num_peerids: OUT: number of entries filled in
+ *
+ * The chain is returned to the kernel as the remote peer's identity.
+ *
+ * Return values:
+ *   %true: @peerids contains the peer's certificates
+ *   %false: The peer presented no certificates
+ */
+bool tlshd_x509_save_peers(gnutls_session_t session, const char *hostname,
+			   key_serial_t *peerids, unsigned int max,
+			   unsigned int *num_peerids)
+{
+	const gnutls_datum_t *peercerts;
+	unsigned int i, count;
+
+	peercerts = gnutls_certificate_get_peers(session, &count);
+	if (!peercerts || count == 0) {
+		tlshd_log_debug("The peer cert list is empty.\n");
+		*num_peerids = 0;
+		return false;
+	}
+
+	tlshd_log_debug("The peer offered %d certificate(s).\n", count);
+
+	if (count > max)
+		count = max;
+	for (i = 0; i < count; i++) {
+		gnutls_x509_crt_t cert;
+
+		gnutls_x509_crt_init(&cert);
+		gnutls_x509_crt_import(cert, &peercerts[i], GNUTLS_X509_FMT_DER);
+		peerids[i] = tlshd_keyring_create_cert(cert, hostname);
+		gnutls_x509_crt_deinit(cert);
+	}
+	*num_peerids = count;
+	return true;
+}
+
+/**
+ * tlshd_set_cert_compression - Offer to compress certificate chains
+ * @session: session to be initialized
+ * @parms: handshake parameters
+ *
+ */
+void tlshd_set_cert_compression(gnutls_session_t session,
+				struct tlshd_handshake_parms *parms)
+{
+#ifdef HAVE_GNUTLS_COMPRESS_CERTIFICATE_SET_METHODS
+	gnutls_compression_method_t methods[TLSHD_MAX_CERT_COMPRESSION];
+	size_t count = ARRAY_SIZE(methods);
+	int ret;
+
+	tlshd_config_get_cert_compression(parms->handshake_type, methods,
+					  &count);
+	if (!count)
+		return;
+	ret = gnutls_compress_certificate_set_methods(session, methods, count);
+	if (ret != GNUTLS_E_SUCCESS)
+		tlshd_log_gnutls_error(ret);
+#else
+	(void)session;
+	(void)parms;
+#endif
+}
+
+/*
+ * TCP options that the kernel consumer set on the socket, which
+ * tlshd changes for the duration of the handshake.
+ */
+struct tlshd_tcp_opts {
+	bool		saved;
+	int		nodelay;
+	int		cork;
+};
+
+/* Set in a handshake child when TCP tuning is enabled */
+static bool tlshd_handshake_quickack;
+
+/*
+ * Send each handshake flight with a single system call. GnuTLS hands
+ * every record of a flight to this function at once.
+ */
+static ssize_t tlshd_handshake_vec_push(gnutls_transport_ptr_t ptr,
+					const giovec_t *iov, int iovcnt)
+{
+	struct msghdr msg = {
+		.msg_iov	= (struct iovec *)iov,
+		.msg_iovlen	= iovcnt,
+	};
+	ssize_t ret;
+
+	tlshd_cost_count_io();
+	ret = sendmsg((int)(intptr_t)ptr, &msg, MSG_NOSIGNAL);
+	if (ret > 0)
+		tlshd_stats_add(TLSHD_STAT_BYTES_SENT, ret);
+	return ret;
+}
+
+/*
+ * The peer's next flight is usually a reply to ours, so acknowledge
+ * it immediately rather than waiting for the delayed ACK timer.
+ * TCP_QUICKACK is not sticky, so it is armed before every receive.
+ */
+static ssize_t tlshd_handshake_pull(gnutls_transport_ptr_t ptr,
+				    void *data, size_t size)
+{
+	int sock = (int)(intptr_t)ptr;
+	int one = 1;
+	ssize_t ret;
+
+	if (tlshd_handshake_quickack) {
+		tlshd_cost_count_io();
+		setsockopt(sock, IPPROTO_TCP, TCP_QUICKACK, &one, sizeof(one));
+	}
+	tlshd_cost_count_io();
+	ret = recv(sock, data, size, 0);
+	if (ret > 0)
+		tlshd_stats_add(TLSHD_STAT_BYTES_RECEIVED, ret);
+	return ret;
+}
+
+static void tlshd_tcp_tune(gnutls_session_t session,
+			   struct tlshd_tcp_opts *opts)
+{
+	int sock = gnutls_transport_get_int(session);
+	socklen_t len;
+	int one = 1;
+	int zero = 0;
+
+	/* These also count the bytes exchanged during the handshake */
+	gnutls_transport_set_vec_push_function(session,
+					       tlshd_handshake_vec_push);
+	gnutls_transport_set_pull_function(session, tlshd_handshake_pull);
+	gnutls_transport_set_pull_timeout_function(session,
+						   gnutls_system_recv_timeout);
+
+	opts->saved = false;
+	tlshd_handshake_quickack = false;
+	if (!tlshd_config_get_tune_handshake())
+		return;
+
+	len = sizeof(opts->nodelay);
+	if (getsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &opts->nodelay,
+		       &len) == -1)
+		return;
+	len = sizeof(opts->cork);
+	if (getsockopt(sock, IPPROTO_TCP, TCP_CORK, &opts->cork, &len) == -1)
+		return;
+	opts->saved = true;
+
+	setsockopt(sock, IPPROTO_TCP, TCP_CORK, &zero, sizeof(zero));
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	tlshd_handshake_quickack = true;
+}
+
+/*
+ * Put back the consumer's options before the socket is handed
+ * to kTLS.
+ */
+static void tlshd_tcp_restore(gnutls_session_t session,
+			      const struct tlshd_tcp_opts *opts)
+{
+	int sock = gnutls_transport_get_int(session);
+
+	if (!opts->saved)
+		return;
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &opts->nodelay,
+		   sizeof(opts->nodelay));
+	setsockopt(sock, IPPROTO_TCP, TCP_CORK, &opts->cork,
+		   sizeof(opts->cork));
+}
+
+/*
+ * A request can wait in the kernel's queue long enough for the
+ * consumer to time out or the peer to hang up. Check for that
+ * before each costly phase so no further work is wasted on it.
+ * The checks cost one poll(2) and one getsockopt(2).
+ */
+static bool tlshd_socket_abandoned(struct tlshd_handshake_parms *parms,
+				   enum tlshd_stat stat)
+{
+	struct pollfd pfd = {
+		.fd		= parms->sockfd,
+		.events		= POLLRDHUP,
+	};
+	struct tcp_info info;
+	socklen_t len = sizeof(info);
+
+	if (poll(&pfd, 1, 0) > 0 &&
+	    (pfd.revents & (POLLRDHUP | POLLERR | POLLHUP | POLLNVAL)))
+		goto abandoned;
+
+	if (getsockopt(parms->sockfd, IPPROTO_TCP, TCP_INFO,
+		       &info, &len) == 0 && info.tcpi_state > TCP_SYN_RECV)
+		goto abandoned;
+	return false;
+
+abandoned:
+	parms->session_status = ENOTCONN;
+	tlshd_stats_inc(stat);
+	return true;
+}
+
+/*
+ * Count the outcome of a handshake request, attributing each failure
+ * to the phase that was under way when it failed.
+ */
+static void tlshd_count_outcome(const struct tlshd_handshake_parms *parms)
+{
+	tlshd_stats_inc(TLSHD_STAT_HANDSHAKES_STARTED);
+	if (!parms->session_status) {
+		tlshd_stats_inc(TLSHD_STAT_HANDSHAKES_SUCCEEDED);
+		return;
+	}
+	/* Already counted by tlshd_socket_abandoned() */
+	if (parms->session_status == ENOTCONN)
+		return;
+
+	switch (parms->failed_phase) {
+	case TLSHD_PHASE_PEERNAME:
+	case TLSHD_PHASE_LOOKUP:
+		tlshd_stats_inc(TLSHD_STAT_FAILED_LOOKUP);
+		break;
+	case TLSHD_PHASE_HANDSHAKE:
+		tlshd_stats_inc(TLSHD_STAT_FAILED_HANDSHAKE);
+		break;
+	case TLSHD_PHASE_KTLS:
+		tlshd_stats_inc(TLSHD_STAT_FAILED_KTLS);
+		break;
+	default:
+		tlshd_stats_inc(TLSHD_STAT_FAILED_SETUP);
+	}
+}
+
+static uint64_t tlshd_handshake_elapsed_us(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000ULL +
+		(now.tv_nsec - start->tv_nsec) / 1000;
+}
 
 /**
  * tlshd_start_tls_handshake - Drive the handshake interaction
@@ -52,11 +421,33 @@
 void tlshd_start_tls_handshake(gnutls_session_t session,
 			       struct tlshd_handshake_parms *parms)
 {
-	char *priorities;
+	struct tlshd_tcp_opts opts;
+	struct timespec start;
+	uint64_t elapsed;
+	char *priorities = NULL;
 	char *desc;
 	int ret;
 
+	if (!tlshd_ktls_available()) {
+		tlshd_log_error("No kTLS ciphers are available.");
+		goto out_free;
+	}
+	if (tlshd_socket_abandoned(parms, TLSHD_STAT_ABANDONED_HANDSHAKE))
+		goto out_free;
+	tlshd_latency_mark(parms, TLSHD_PHASE_CREDENTIALS);
+	TLSHD_PROBE_PARMS(handshake_start, parms);
+
 	priorities = tlshd_make_priorities_string(parms);
+	if (priorities && parms->key_share_group != GNUTLS_GROUP_INVALID) {
+		char *predicted;
+
+		predicted = tlshd_prefer_group(priorities,
+					       parms->key_share_group);
+		if (predicted) {
+			free(priorities);
+			priorities = predicted;
+		}
+	}
 	if (priorities) {
 		const char *err_pos;
 
@@ -76,10 +467,23 @@ void tlshd_start_tls_handshake(gnutls_session_t session,
 		}
 	}
 
+	gnutls_handshake_set_hook_function(session, GNUTLS_HANDSHAKE_ANY,
+					   GNUTLS_HOOK_POST,
+					   tlshd_handshake_hook);
 	gnutls_handshake_set_timeout(session, parms->timeout_ms);
+	tlshd_set_record_size_limit(session, parms);
+	tlshd_tcp_tune(session, &opts);
+	tlshd_cost_gnutls_begin();
+	parms->failed_phase = TLSHD_PHASE_HANDSHAKE;
+	clock_gettime(CLOCK_MONOTONIC, &start);
 	do {
 		ret = gnutls_handshake(session);
 	} while (ret < 0 && !gnutls_error_is_fatal(ret));
+	elapsed = tlshd_handshake_elapsed_us(&start);
+	tlshd_cost_gnutls_end(session);
+	tlshd_latency_mark(parms, TLSHD_PHASE_HANDSHAKE);
+	TLSHD_PROBE_PARMS(handshake_end, parms, ret);
+	tlshd_tcp_restore(session, &opts);
 	if (ret < 0) {
 		switch (ret) {
 		case GNUTLS_E_CERTIFICATE_VERIFICATION_ERROR:
@@ -88,15 +492,36 @@ void tlshd_start_tls_handshake(gnutls_session_t session,
 		default:
 			tlshd_log_gnutls_error(ret);
 		}
+		tlshd_stats_gnutls_error(ret);
 		parms->session_status = EACCES;
 		goto out_free;
 	}
 
+	if (gnutls_session_is_resumed(session))
+		tlshd_stats_inc(TLSHD_STAT_SESSIONS_RESUMED);
+	tlshd_events_capture(session, parms);
+
 	desc = gnutls_session_get_desc(session);
 	tlshd_log_debug("Session description: %s", desc);
 	gnutls_free(desc);
 
-	parms->session_status = tlshd_initialize_ktls(session);
+	tlshd_log_debug("Handshake completed in %llu usec (%s)",
+			(unsigned long long)elapsed,
+			opts.saved ? "tuned" : "untuned");
+	if (opts.saved) {
+		tlshd_stats_add(TLSHD_STAT_HANDSHAKES_TUNED, 1);
+		tlshd_stats_add(TLSHD_STAT_HANDSHAKE_USEC_TUNED, elapsed);
+	} else {
+		tlshd_stats_add(TLSHD_STAT_HANDSHAKES_UNTUNED, 1);
+		tlshd_stats_add(TLSHD_STAT_HANDSHAKE_USEC_UNTUNED, elapsed);
+	}
+
+	tlshd_cache_remember_group(session, parms);
+	parms->failed_phase = TLSHD_PHASE_KTLS;
+	parms->session_status = tlshd_initialize_ktls(session, parms);
+	tlshd_latency_mark(parms, TLSHD_PHASE_KTLS);
+	TLSHD_PROBE_PARMS(ktls, parms, gnutls_cipher_get(session),
+			  parms->session_status);
 
 out_free:
 	free(priorities);
@@ -109,31 +534,48 @@ out_free:
 void tlshd_service_socket(void)
 {
 	static char peername[NI_MAXHOST] = "unknown";
+	static char peeraddr_text[NI_MAXHOST];
 	struct tlshd_handshake_parms parms;
 	static struct sockaddr_storage ss;
 	static socklen_t peeraddr_len;
 	struct sockaddr *peeraddr = (struct sockaddr *)&ss;
 	int ret;
 
+	tlshd_cost_begin();
 	memset(&ss, 0, sizeof(ss));
 	peeraddr_len = 0;
 	if (tlshd_genl_get_handshake_parms(&parms) != 0)
 		goto out;
+	if (tlshd_socket_abandoned(&parms, TLSHD_STAT_ABANDONED_LOOKUP))
+		goto out;
 
 	peeraddr_len = sizeof(ss);
 	if (getpeername(parms.sockfd, peeraddr, &peeraddr_len) == -1) {
 		tlshd_log_perror("getpeername");
 		goto out;
 	}
+	/* Formatted once, for logging, kTLS peer matching and events */
+	if (!getnameinfo(peeraddr, peeraddr_len, peeraddr_text,
+			 sizeof(peeraddr_text), NULL, 0, NI_NUMERICHOST))
+		parms.peeraddr_text = peeraddr_text;
+	tlshd_latency_mark(&parms, TLSHD_PHASE_PEERNAME);
 
+	parms.failed_phase = TLSHD_PHASE_LOOKUP;
 	ret = getnameinfo(peeraddr, peeraddr_len, peername, sizeof(peername),
 			  NULL, 0, NI_NAMEREQD);
 	if (ret) {
 		tlshd_log_gai_error(ret);
 		goto out;
 	}
+	tlshd_latency_mark(&parms, TLSHD_PHASE_LOOKUP);
+	TLSHD_PROBE_PARMS(resolved, &parms, peername);
 	parms.peername = peername;
+	parms.peeraddr = peeraddr;
+	parms.peeraddr_len = peeraddr_len;
+	if (tlshd_socket_abandoned(&parms, TLSHD_STAT_ABANDONED_CREDENTIALS))
+		goto out;
 
+	parms.failed_phase = TLSHD_PHASE_CREDENTIALS;
 	switch (parms.handshake_type) {
 	case HANDSHAKE_MSG_TYPE_CLIENTHELLO:
 		tlshd_clienthello_handshake(&parms);
@@ -148,12 +590,27 @@ void tlshd_service_socket(void)
 
 out:
 	tlshd_genl_done(&parms);
+	tlshd_stats_add(TLSHD_STAT_IN_FLIGHT, -1);
+	if (parms.handshake_type != HANDSHAKE_MSG_TYPE_UNSPEC) {
+		tlshd_count_outcome(&parms);
+		tlshd_latency_mark(&parms, TLSHD_PHASE_DONE);
+		TLSHD_PROBE_PARMS(done, &parms, parms.session_status);
+		tlshd_cost_end(&parms);
+		tlshd_events_write(&parms);
+		tlshd_trace_end(&parms);
+	}
+	tlshd_latency_finish();
 
 	free(parms.peerids);
 
+	if (parms.session_status == ENOTCONN) {
+		tlshd_log_debug("Handshake with '%s' abandoned by the consumer or peer",
+				peername);
+		return;
+	}
 	if (parms.session_status) {
-		tlshd_log_failure(peername, peeraddr, peeraddr_len);
+		tlshd_log_failure(peername, parms.peeraddr_text);
 		return;
 	}
-	tlshd_log_success(peername, peeraddr, peeraddr_len);
+	tlshd_log_success(peername, parms.peeraddr_text);
 }
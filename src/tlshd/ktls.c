@@ -25,10 +25,21 @@
 #include <sys/socket.h>
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
 
+#include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
 #include <keyutils.h>
 
 #include <gnutls/gnutls.h>
@@ -42,6 +53,111 @@
 #include "tlshd.h"
 #include "netlink.h"
 
+/*
+ * Every kTLS crypto_info structure has the same layout, but the
+ * field sizes differ by cipher.
+ */
+struct tlshd_ktls_cipher {
+	const char			*name;
+	gnutls_cipher_algorithm_t	cipher;
+	unsigned short			type;
+	enum tlshd_stat			stat;
+	socklen_t			infolen;
+	unsigned char			key_size;
+	unsigned char			iv_size;
+	unsigned char			salt_size;
+	unsigned char			rec_seq_size;
+	unsigned char			key_offset;
+	unsigned char			iv_offset;
+	unsigned char			salt_offset;
+	unsigned char			rec_seq_offset;
+};
+
+#define TLSHD_KTLS_CIPHER(_name, _cipher, _type, _info)			\
+	{								\
+		.name		= _name,				\
+		.cipher		= _cipher,				\
+		.type		= TLS_CIPHER_##_type,			\
+		.stat		= TLSHD_STAT_CIPHER_##_type,		\
+		.infolen	= sizeof(struct _info),			\
+		.key_size	= TLS_CIPHER_##_type##_KEY_SIZE,	\
+		.iv_size	= TLS_CIPHER_##_type##_IV_SIZE,		\
+		.salt_size	= TLS_CIPHER_##_type##_SALT_SIZE,	\
+		.rec_seq_size	= TLS_CIPHER_##_type##_REC_SEQ_SIZE,	\
+		.key_offset	= offsetof(struct _info, key),		\
+		.iv_offset	= offsetof(struct _info, iv),		\
+		.salt_offset	= offsetof(struct _info, salt),		\
+		.rec_seq_offset	= offsetof(struct _info, rec_seq),	\
+	}
+
+/*
+ * Handshakes must negotiate only ciphers that are supported
+ * by kTLS. The list below contains the TLS 1.3 ciphers that are
+ * common to both kTLS and GnuTLS (Linux v6.2, GnuTLS 3.8.0).
+ *
+ * List is ordered from cryptographically strongest to weakest.
+ */
+static const struct tlshd_ktls_cipher tlshd_ktls_ciphers[] = {
+#if defined(TLS_CIPHER_CHACHA20_POLY1305)
+	TLSHD_KTLS_CIPHER("CHACHA20-POLY1305", GNUTLS_CIPHER_CHACHA20_POLY1305,
+			  CHACHA20_POLY1305,
+			  tls12_crypto_info_chacha20_poly1305),
+#endif
+#if defined(TLS_CIPHER_AES_GCM_256)
+	TLSHD_KTLS_CIPHER("AES-256-GCM", GNUTLS_CIPHER_AES_256_GCM,
+			  AES_GCM_256, tls12_crypto_info_aes_gcm_256),
+#endif
+#if defined(TLS_CIPHER_AES_GCM_128)
+	TLSHD_KTLS_CIPHER("AES-128-GCM", GNUTLS_CIPHER_AES_128_GCM,
+			  AES_GCM_128, tls12_crypto_info_aes_gcm_128),
+#endif
+#if defined(TLS_CIPHER_AES_CCM_128)
+	TLSHD_KTLS_CIPHER("AES-128-CCM", GNUTLS_CIPHER_AES_128_CCM,
+			  AES_CCM_128, tls12_crypto_info_aes_ccm_128),
+#endif
+#if defined(TLS_CIPHER_SM4_GCM) && HAVE_DECL_GNUTLS_CIPHER_SM4_GCM
+	TLSHD_KTLS_CIPHER("SM4-GCM", GNUTLS_CIPHER_SM4_GCM,
+			  SM4_GCM, tls12_crypto_info_sm4_gcm),
+#endif
+#if defined(TLS_CIPHER_SM4_CCM) && HAVE_DECL_GNUTLS_CIPHER_SM4_CCM
+	TLSHD_KTLS_CIPHER("SM4-CCM", GNUTLS_CIPHER_SM4_CCM,
+			  SM4_CCM, tls12_crypto_info_sm4_ccm),
+#endif
+};
+
+/* Large enough for any cipher's crypto_info structure */
+union tlshd_ktls_info {
+	struct tls_crypto_info		info;
+	unsigned char			buf[256];
+};
+
+/*
+ * What the running kernel supports, and the order in which ciphers
+ * appear in the priorities string. A re-probe fills in the copy that
+ * is not in use and then publishes it, so that a handshake child
+ * forked at any moment inherits a consistent set.
+ */
+struct tlshd_ktls_state {
+	/* Ciphers that the running kernel was able to install */
+	bool				supported[ARRAY_SIZE(tlshd_ktls_ciphers)];
+	const struct tlshd_ktls_cipher	*order[ARRAY_SIZE(tlshd_ktls_ciphers)];
+	unsigned int			num_ciphers;
+};
+
+static struct tlshd_ktls_state tlshd_ktls_states[2];
+static struct tlshd_ktls_state *tlshd_ktls_current = &tlshd_ktls_states[0];
+
+/* Throughput measured at start-up, in bytes per second */
+static uint64_t tlshd_ktls_rate[ARRAY_SIZE(tlshd_ktls_ciphers)];
+
+static guint tlshd_ktls_module;
+static bool tlshd_ktls_probing;
+
+static struct tlshd_ktls_state *tlshd_ktls_state(void)
+{
+	return __atomic_load_n(&tlshd_ktls_current, __ATOMIC_ACQUIRE);
+}
+
 #ifdef HAVE_GNUTLS_TRANSPORT_IS_KTLS_ENABLED
 static bool tlshd_is_ktls_enabled(gnutls_session_t session, unsigned read)
 {
@@ -96,57 +212,50 @@ static bool tlshd_setsockopt(int sock, unsigned read, const void *info,
 	return false;
 }
 
-#if defined(TLS_CIPHER_AES_GCM_128)
-static bool tlshd_set_aes_gcm128_info(gnutls_session_t session, int sock,
-				      unsigned read)
+static const struct tlshd_ktls_cipher *
+tlshd_ktls_lookup(gnutls_cipher_algorithm_t algorithm)
 {
-	struct tls12_crypto_info_aes_gcm_128 info = {
-		.info.version		= TLS_1_3_VERSION,
-		.info.cipher_type	= TLS_CIPHER_AES_GCM_128,
-	};
-	unsigned char seq_number[8];
-	gnutls_datum_t cipher_key;
-	gnutls_datum_t mac_key;
-	gnutls_datum_t iv;
-	int ret;
+	unsigned int i;
 
-	if (tlshd_is_ktls_enabled(session, read))
-		return true;
-
-	ret = gnutls_record_get_state(session, read, &mac_key, &iv,
-				      &cipher_key, seq_number);
-	if (ret != GNUTLS_E_SUCCESS) {
-		tlshd_log_gnutls_error(ret);
-		return false;
-	}
+	for (i = 0; i < ARRAY_SIZE(tlshd_ktls_ciphers); i++)
+		if (tlshd_ktls_ciphers[i].cipher == algorithm)
+			return &tlshd_ktls_ciphers[i];
+	return NULL;
+}
 
-	/* TLSv1.2 generates iv in the kernel */
-	if (gnutls_protocol_get_version(session) == GNUTLS_TLS1_2) {
-		info.info.version = TLS_1_2_VERSION;
-		memcpy(info.iv, seq_number, TLS_CIPHER_AES_GCM_128_IV_SIZE);
-	} else
-		memcpy(info.iv, iv.data + TLS_CIPHER_AES_GCM_128_SALT_SIZE,
-		       TLS_CIPHER_AES_GCM_128_IV_SIZE);
-	memcpy(info.salt, iv.data, TLS_CIPHER_AES_GCM_128_SALT_SIZE);
-	memcpy(info.key, cipher_key.data, TLS_CIPHER_AES_GCM_128_KEY_SIZE);
-	memcpy(info.rec_seq, seq_number, TLS_CIPHER_AES_GCM_128_REC_SEQ_SIZE);
-
-	return tlshd_setsockopt(sock, read, &info, sizeof(info));
+/*
+ * @iv carries the salt, for ciphers that use one, followed by
+ * the nonce.
+ */
+static void tlshd_ktls_fill_info(const struct tlshd_ktls_cipher *cipher,
+				 unsigned short version,
+				 union tlshd_ktls_info *info,
+				 const unsigned char *key,
+				 const unsigned char *iv,
+				 const unsigned char *rec_seq)
+{
+	memset(info, 0, sizeof(*info));
+	info->info.version = version;
+	info->info.cipher_type = cipher->type;
+	memcpy(info->buf + cipher->key_offset, key, cipher->key_size);
+	memcpy(info->buf + cipher->salt_offset, iv, cipher->salt_size);
+	memcpy(info->buf + cipher->iv_offset, iv + cipher->salt_size,
+	       cipher->iv_size);
+	memcpy(info->buf + cipher->rec_seq_offset, rec_seq,
+	       cipher->rec_seq_size);
 }
-#endif
 
-#if defined(TLS_CIPHER_AES_GCM_256)
-static bool tlshd_set_aes_gcm256_info(gnutls_session_t session, int sock,
-				      unsigned read)
+static bool tlshd_set_crypto_info(gnutls_session_t session,
+				  const struct tlshd_ktls_cipher *cipher,
+				  int sock, unsigned read)
 {
-	struct tls12_crypto_info_aes_gcm_256 info = {
-		.info.version		= TLS_1_3_VERSION,
-		.info.cipher_type	= TLS_CIPHER_AES_GCM_256,
-	};
+	unsigned short version = TLS_1_3_VERSION;
+	union tlshd_ktls_info info;
 	unsigned char seq_number[8];
 	gnutls_datum_t cipher_key;
 	gnutls_datum_t mac_key;
 	gnutls_datum_t iv;
+	bool result;
 	int ret;
 
 	if (tlshd_is_ktls_enabled(session, read))
@@ -159,103 +268,230 @@ static bool tlshd_set_aes_gcm256_info(gnutls_session_t session, int sock,
 		return false;
 	}
 
+	if (gnutls_protocol_get_version(session) == GNUTLS_TLS1_2)
+		version = TLS_1_2_VERSION;
+	tlshd_ktls_fill_info(cipher, version, &info, cipher_key.data,
+			     iv.data, seq_number);
+
 	/* TLSv1.2 generates iv in the kernel */
-	if (gnutls_protocol_get_version(session) == GNUTLS_TLS1_2) {
-		info.info.version = TLS_1_2_VERSION;
-		memcpy(info.iv, seq_number, TLS_CIPHER_AES_GCM_256_IV_SIZE);
-	} else
-		memcpy(info.iv, iv.data + TLS_CIPHER_AES_GCM_256_SALT_SIZE,
-		       TLS_CIPHER_AES_GCM_256_IV_SIZE);
-	memcpy(info.salt, iv.data, TLS_CIPHER_AES_GCM_256_SALT_SIZE);
-	memcpy(info.key, cipher_key.data, TLS_CIPHER_AES_GCM_256_KEY_SIZE);
-	memcpy(info.rec_seq, seq_number, TLS_CIPHER_AES_GCM_256_REC_SEQ_SIZE);
-
-	return tlshd_setsockopt(sock, read, &info, sizeof(info));
+	if (version == TLS_1_2_VERSION && cipher->salt_size)
+		memcpy(info.buf + cipher->iv_offset, seq_number,
+		       cipher->iv_size);
+
+	result = tlshd_setsockopt(sock, read, &info, cipher->infolen);
+	explicit_bzero(&info, sizeof(info));
+	return result;
 }
-#endif
 
-#if defined(TLS_CIPHER_AES_CCM_128)
-static bool tlshd_set_aes_ccm128_info(gnutls_session_t session, int sock,
-				      unsigned read)
+/*
+ * Optional kTLS socket options are set only after the crypto info
+ * is in place. Failure to set one is not fatal; the socket continues
+ * to work with the kernel's default behavior.
+ */
+static void tlshd_set_tx_zerocopy(int sock,
+				  struct tlshd_handshake_parms *parms)
 {
-	struct tls12_crypto_info_aes_ccm_128 info = {
-		.info.version		= TLS_1_3_VERSION,
-		.info.cipher_type	= TLS_CIPHER_AES_CCM_128,
-	};
-	unsigned char seq_number[8];
-	gnutls_datum_t cipher_key;
-	gnutls_datum_t mac_key;
-	gnutls_datum_t iv;
-	int ret;
-
-	if (tlshd_is_ktls_enabled(session, read))
-		return true;
-
-	ret = gnutls_record_get_state(session, read, &mac_key, &iv,
-				      &cipher_key, seq_number);
-	if (ret != GNUTLS_E_SUCCESS) {
-		tlshd_log_gnutls_error(ret);
-		return false;
+#if defined(TLS_TX_ZEROCOPY_RO)
+	unsigned int value = 1;
+
+	if (!tlshd_config_get_ktls_bool(parms->auth_mode, "tx_zerocopy"))
+		return;
+
+	if (setsockopt(sock, SOL_TLS, TLS_TX_ZEROCOPY_RO, &value,
+		       sizeof(value)) == -1) {
+		tlshd_log_debug("Failed to enable kTLS TX zerocopy: %s",
+				strerror(errno));
+		tlshd_stats_inc(TLSHD_STAT_TX_ZEROCOPY_FAILED);
+		return;
 	}
-
-	/* TLSv1.2 generates iv in the kernel */
-	if (gnutls_protocol_get_version(session) == GNUTLS_TLS1_2) {
-		info.info.version = TLS_1_2_VERSION;
-		memcpy(info.iv, seq_number, TLS_CIPHER_AES_CCM_128_IV_SIZE);
-	} else
-		memcpy(info.iv, iv.data + TLS_CIPHER_AES_CCM_128_SALT_SIZE,
-		       TLS_CIPHER_AES_CCM_128_IV_SIZE);
-	memcpy(info.salt, iv.data, TLS_CIPHER_AES_CCM_128_SALT_SIZE);
-	memcpy(info.key, cipher_key.data, TLS_CIPHER_AES_CCM_128_KEY_SIZE);
-	memcpy(info.rec_seq, seq_number, TLS_CIPHER_AES_CCM_128_REC_SEQ_SIZE);
-
-	return tlshd_setsockopt(sock, read, &info, sizeof(info));
+	parms->ktls_flags |= TLSHD_KTLS_TX_ZEROCOPY;
+	tlshd_stats_inc(TLSHD_STAT_TX_ZEROCOPY);
+	tlshd_log_debug("kTLS TX zerocopy enabled");
+#else
+	if (tlshd_config_get_ktls_bool(parms->auth_mode, "tx_zerocopy"))
+		tlshd_stats_inc(TLSHD_STAT_TX_ZEROCOPY_FAILED);
+	(void)sock;
+#endif
 }
+
+/*
+ * Records sent by the kernel are limited to the smaller of the peer's
+ * record_size_limit and the local "record_size_limit" setting, so
+ * that the record size can be matched to the consumer's typical
+ * payload size.
+ */
+static void tlshd_set_tx_max_payload(gnutls_session_t session, int sock,
+				     struct tlshd_handshake_parms *parms)
+{
+#if defined(TLS_TX_MAX_PAYLOAD_LEN)
+	uint64_t limit;
+	uint16_t value;
+	size_t size;
+
+	size = gnutls_record_get_max_size(session);
+	limit = tlshd_config_get_ktls_uint64(parms->auth_mode,
+					     "record_size_limit");
+	if (limit && limit < size)
+		size = limit;
+	if (size >= TLSHD_RECORD_SIZE_MAX)
+		return;
+
+	value = size;
+	if (setsockopt(sock, SOL_TLS, TLS_TX_MAX_PAYLOAD_LEN, &value,
+		       sizeof(value)) == -1) {
+		tlshd_log_debug("Failed to set kTLS TX max payload: %s",
+				strerror(errno));
+		return;
+	}
+	tlshd_log_debug("kTLS TX records carry at most %u bytes",
+			(unsigned int)value);
+#else
+	(void)session;
+	(void)sock;
+	(void)parms;
 #endif
+}
 
-#if defined(TLS_CIPHER_CHACHA20_POLY1305)
-static bool tlshd_set_chacha20_poly1305_info(gnutls_session_t session, int sock,
-					     unsigned read)
+/*
+ * Returns true if @parms's peer matches one of the patterns in the
+ * "rx_expect_no_pad_peers" setting, or if that setting is absent.
+ */
+static bool tlshd_peer_does_not_pad(struct tlshd_handshake_parms *parms)
 {
-	struct tls12_crypto_info_chacha20_poly1305 info = {
-		.info.version		= TLS_1_3_VERSION,
-		.info.cipher_type	= TLS_CIPHER_CHACHA20_POLY1305,
-	};
-	unsigned char seq_number[8];
-	gnutls_datum_t cipher_key;
-	gnutls_datum_t mac_key;
-	gnutls_datum_t iv;
-	int ret;
+	gsize i, length;
+	gchar **peers;
+	bool ret;
 
-	if (tlshd_is_ktls_enabled(session, read))
+	peers = tlshd_config_get_ktls_list(parms->auth_mode,
+					   "rx_expect_no_pad_peers", &length);
+	if (!peers)
 		return true;
 
-	ret = gnutls_record_get_state(session, read, &mac_key, &iv,
-				      &cipher_key, seq_number);
-	if (ret != GNUTLS_E_SUCCESS) {
-		tlshd_log_gnutls_error(ret);
-		return false;
+	ret = false;
+	for (i = 0; i < length; i++) {
+		const gchar *pattern = g_strstrip(peers[i]);
+
+		if ((parms->peername &&
+		     g_pattern_match_simple(pattern, parms->peername)) ||
+		    (parms->peeraddr_text &&
+		     g_pattern_match_simple(pattern, parms->peeraddr_text))) {
+			ret = true;
+			break;
+		}
 	}
+	g_strfreev(peers);
+	return ret;
+}
 
-	if (gnutls_protocol_get_version(session) == GNUTLS_TLS1_2)
-		info.info.version = TLS_1_2_VERSION;
+/*
+ * With TLS 1.3, the kernel can decrypt a received record directly
+ * into the consumer's buffer if it knows in advance that the record
+ * carries no padding. If a padded record does arrive, the kernel
+ * decrypts it again the slow way and stops expecting no padding on
+ * that socket.
+ */
+static void tlshd_set_rx_no_pad(gnutls_session_t session, int sock,
+				struct tlshd_handshake_parms *parms)
+{
+#if defined(TLS_RX_EXPECT_NO_PAD)
+	unsigned int value = 1;
+
+	if (!tlshd_config_get_ktls_bool(parms->auth_mode, "rx_expect_no_pad"))
+		return;
+	if (gnutls_protocol_get_version(session) != GNUTLS_TLS1_3)
+		return;
+	if (!tlshd_peer_does_not_pad(parms))
+		return;
+
+	if (setsockopt(sock, SOL_TLS, TLS_RX_EXPECT_NO_PAD, &value,
+		       sizeof(value)) == -1) {
+		tlshd_log_debug("Failed to enable kTLS RX no-pad: %s",
+				strerror(errno));
+		return;
+	}
+	parms->ktls_flags |= TLSHD_KTLS_RX_NO_PAD;
+	tlshd_stats_inc(TLSHD_STAT_RX_NO_PAD);
+	tlshd_log_debug("kTLS RX expects no padding");
+#else
+	(void)session;
+	(void)sock;
+	(void)parms;
+#endif
+}
 
-	memcpy(info.iv, iv.data, TLS_CIPHER_CHACHA20_POLY1305_IV_SIZE);
-	memcpy(info.key, cipher_key.data, TLS_CIPHER_CHACHA20_POLY1305_KEY_SIZE);
-	memcpy(info.rec_seq, seq_number, TLS_CIPHER_CHACHA20_POLY1305_REC_SEQ_SIZE);
+/**
+ * tlshd_set_record_size_limit - Advertise a record_size_limit
+ * @session: session to be initialized
+ * @parms: handshake parameters
+ *
+ * Asks the peer to send records no larger than the "record_size_limit"
+ * setting for this session's authentication mode. A session whose
+ * limit is not set uses the protocol maximum.
+ */
+void tlshd_set_record_size_limit(gnutls_session_t session,
+				 struct tlshd_handshake_parms *parms)
+{
+#ifdef HAVE_GNUTLS_RECORD_SET_MAX_RECV_SIZE
+	uint64_t limit;
+	ssize_t ret;
+
+	limit = tlshd_config_get_ktls_uint64(parms->auth_mode,
+					     "record_size_limit");
+	if (!limit)
+		return;
+	if (limit < TLSHD_RECORD_SIZE_MIN || limit > TLSHD_RECORD_SIZE_MAX) {
+		tlshd_log_error("record_size_limit %llu is out of range",
+				(unsigned long long)limit);
+		return;
+	}
 
-	return tlshd_setsockopt(sock, read, &info, sizeof(info));
-}
+	ret = gnutls_record_set_max_recv_size(session, limit);
+	if (ret < 0)
+		tlshd_log_gnutls_error(ret);
+#else
+	if (tlshd_config_get_ktls_uint64(parms->auth_mode,
+					 "record_size_limit"))
+		tlshd_log_debug("GnuTLS cannot send record_size_limit");
+	(void)session;
 #endif
+}
+
+/**
+ * tlshd_ktls_kernel_stat - Read one of the kernel's kTLS counters
+ * @name: name of a counter in /proc/net/tls_stat
+ *
+ * Returns the counter's value, or zero if it is not available.
+ */
+uint64_t tlshd_ktls_kernel_stat(const char *name)
+{
+	unsigned long long value;
+	char label[64];
+	uint64_t ret = 0;
+	FILE *fp;
+
+	fp = fopen("/proc/net/tls_stat", "re");
+	if (!fp)
+		return 0;
+	while (fscanf(fp, "%63s %llu", label, &value) == 2)
+		if (!strcmp(label, name)) {
+			ret = value;
+			break;
+		}
+	fclose(fp);
+	return ret;
+}
 
 /**
  * tlshd_initialize_ktls - Initialize socket for use by kTLS
  * @session: TLS session descriptor
+ * @parms: handshake parameters
  *
- * Returns zero on success, or a negative errno value.
+ * Returns zero on success, or a positive errno value.
  */
-int tlshd_initialize_ktls(gnutls_session_t session)
+int tlshd_initialize_ktls(gnutls_session_t session,
+			  struct tlshd_handshake_parms *parms)
 {
+	const struct tlshd_ktls_cipher *cipher;
 	int sockin, sockout;
 
 	if (setsockopt(gnutls_transport_get_int(session), SOL_TCP, TCP_ULP,
@@ -266,32 +502,423 @@ int tlshd_initialize_ktls(gnutls_session_t session)
 
 	gnutls_transport_get_int2(session, &sockin, &sockout);
 
-	switch (gnutls_cipher_get(session)) {
-#if defined(TLS_CIPHER_AES_GCM_128)
-	case GNUTLS_CIPHER_AES_128_GCM:
-		return tlshd_set_aes_gcm128_info(session, sockout, 0) &&
-			tlshd_set_aes_gcm128_info(session, sockin, 1) ? 0 : EIO;
-#endif
-#if defined(TLS_CIPHER_AES_GCM_256)
-	case GNUTLS_CIPHER_AES_256_GCM:
-		return tlshd_set_aes_gcm256_info(session, sockout, 0) &&
-			tlshd_set_aes_gcm256_info(session, sockin, 1) ? 0 : EIO;
-#endif
-#if defined(TLS_CIPHER_AES_CCM_128)
-	case GNUTLS_CIPHER_AES_128_CCM:
-		return tlshd_set_aes_ccm128_info(session, sockout, 0) &&
-			tlshd_set_aes_ccm128_info(session, sockin, 1) ? 0 : EIO;
-#endif
-#if defined(TLS_CIPHER_CHACHA20_POLY1305)
-	case GNUTLS_CIPHER_CHACHA20_POLY1305:
-		return tlshd_set_chacha20_poly1305_info(session, sockout, 0) &&
-			tlshd_set_chacha20_poly1305_info(session, sockin, 1) ? 0 : EIO;
-#endif
-	default:
+	cipher = tlshd_ktls_lookup(gnutls_cipher_get(session));
+	if (!cipher) {
 		tlshd_log_error("tlshd does not support the requested cipher.");
+		return EIO;
+	}
+	if (!tlshd_set_crypto_info(session, cipher, sockout, 0) ||
+	    !tlshd_set_crypto_info(session, cipher, sockin, 1))
+		return EIO;
+
+	tlshd_stats_inc(cipher->stat);
+
+	tlshd_set_tx_zerocopy(sockout, parms);
+	tlshd_set_tx_max_payload(session, sockout, parms);
+	tlshd_set_rx_no_pad(session, sockin, parms);
+	return 0;
+}
+
+/*
+ * Create a connected pair of TCP sockets on the loopback interface.
+ */
+static bool tlshd_ktls_loopback(int sv[2])
+{
+	struct sockaddr_in sin = {
+		.sin_family		= AF_INET,
+		.sin_addr.s_addr	= htonl(INADDR_LOOPBACK),
+	};
+	socklen_t len = sizeof(sin);
+	int lsock;
+
+	sv[0] = sv[1] = -1;
+	lsock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (lsock == -1) {
+		tlshd_log_perror("socket");
+		return false;
+	}
+	if (bind(lsock, (struct sockaddr *)&sin, sizeof(sin)) == -1 ||
+	    listen(lsock, 1) == -1 ||
+	    getsockname(lsock, (struct sockaddr *)&sin, &len) == -1) {
+		tlshd_log_perror("loopback listener");
+		goto out_close;
+	}
+
+	sv[0] = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sv[0] == -1) {
+		tlshd_log_perror("socket");
+		goto out_close;
+	}
+	if (connect(sv[0], (struct sockaddr *)&sin, len) == -1) {
+		tlshd_log_perror("connect");
+		goto out_close;
+	}
+	sv[1] = accept4(lsock, NULL, NULL, SOCK_CLOEXEC);
+	if (sv[1] == -1) {
+		tlshd_log_perror("accept");
+		goto out_close;
+	}
+
+	close(lsock);
+	return true;
+
+out_close:
+	if (sv[0] != -1)
+		close(sv[0]);
+	sv[0] = -1;
+	close(lsock);
+	return false;
+}
+
+/*
+ * Program a throw-away key into both ends of a loopback socket pair.
+ * Records sent on sv[0] are encrypted by the kernel and decrypted
+ * again when received on sv[1].
+ */
+static bool tlshd_ktls_loopback_install(const struct tlshd_ktls_cipher *cipher,
+					int sv[2])
+{
+	union tlshd_ktls_info crypto_info;
+
+	memset(&crypto_info, 0, sizeof(crypto_info));
+	crypto_info.info.version = TLS_1_3_VERSION;
+	crypto_info.info.cipher_type = cipher->type;
+
+	if (setsockopt(sv[0], SOL_TCP, TCP_ULP, "tls", sizeof("tls")) == -1 ||
+	    setsockopt(sv[1], SOL_TCP, TCP_ULP, "tls", sizeof("tls")) == -1)
+		return false;
+	if (setsockopt(sv[0], SOL_TLS, TLS_TX, &crypto_info,
+		       cipher->infolen) == -1)
+		return false;
+	if (setsockopt(sv[1], SOL_TLS, TLS_RX, &crypto_info,
+		       cipher->infolen) == -1)
+		return false;
+	return true;
+}
+
+static uint64_t tlshd_ktls_elapsed_ns(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000000ULL +
+		now.tv_nsec - start->tv_nsec;
+}
+
+/*
+ * Returns the kernel's bulk encrypt+decrypt throughput for @cipher,
+ * in bytes per second, or zero if @cipher could not be measured.
+ */
+static uint64_t tlshd_ktls_benchmark(const struct tlshd_ktls_cipher *cipher)
+{
+	static unsigned char buf[TLSHD_BENCH_RECORD_SIZE];
+	size_t sent = 0, received = 0;
+	struct pollfd pfd[2];
+	struct timespec start;
+	uint64_t elapsed;
+	uint64_t result = 0;
+	int sv[2];
+	ssize_t n;
+
+	if (!tlshd_ktls_loopback(sv))
+		return 0;
+	if (!tlshd_ktls_loopback_install(cipher, sv))
+		goto out_close;
+	if (fcntl(sv[0], F_SETFL, O_NONBLOCK) == -1 ||
+	    fcntl(sv[1], F_SETFL, O_NONBLOCK) == -1)
+		goto out_close;
+
+	pfd[0].fd = sv[0];
+	pfd[1].fd = sv[1];
+	pfd[1].events = POLLIN;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (received < TLSHD_BENCH_BYTES) {
+		pfd[0].events = sent < TLSHD_BENCH_BYTES ? POLLOUT : 0;
+		if (poll(pfd, 2, TLSHD_BENCH_TIMEOUT_MS) <= 0)
+			goto out_close;
+		if (pfd[0].revents & POLLOUT) {
+			n = send(sv[0], buf, sizeof(buf), 0);
+			if (n == -1 && errno != EAGAIN)
+				goto out_close;
+			if (n > 0)
+				sent += n;
+		}
+		if (pfd[1].revents & POLLIN) {
+			n = recv(sv[1], buf, sizeof(buf), 0);
+			if (n <= 0 && errno != EAGAIN)
+				goto out_close;
+			if (n > 0)
+				received += n;
+		}
+		if ((pfd[0].revents | pfd[1].revents) & (POLLERR | POLLHUP))
+			goto out_close;
+	}
+	elapsed = tlshd_ktls_elapsed_ns(&start);
+	if (elapsed)
+		result = (uint64_t)received * 1000000000ULL / elapsed;
+
+out_close:
+	close(sv[0]);
+	close(sv[1]);
+	return result;
+}
+
+static const struct tlshd_ktls_cipher *tlshd_ktls_find_cipher(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(tlshd_ktls_ciphers); i++)
+		if (!strcasecmp(tlshd_ktls_ciphers[i].name, name))
+			return &tlshd_ktls_ciphers[i];
+	return NULL;
+}
+
+/*
+ * Use the order specified by the administrator. Ciphers that are
+ * not listed are not offered. If no listed cipher can be used, the
+ * default order is kept rather than refusing every handshake.
+ */
+static void tlshd_ktls_order_pinned(struct tlshd_ktls_state *state,
+				    gchar **names, gsize length)
+{
+	const struct tlshd_ktls_cipher *order[ARRAY_SIZE(tlshd_ktls_ciphers)];
+	const struct tlshd_ktls_cipher *cipher;
+	unsigned int i, j, count = 0;
+
+	for (i = 0; i < length; i++) {
+		cipher = tlshd_ktls_find_cipher(g_strstrip(names[i]));
+		if (!cipher) {
+			tlshd_log_error("Cipher '%s' is not supported by kTLS",
+					names[i]);
+			continue;
+		}
+		if (!state->supported[cipher - tlshd_ktls_ciphers])
+			continue;
+		for (j = 0; j < count; j++)
+			if (order[j] == cipher)
+				break;
+		if (j == count)
+			order[count++] = cipher;
+	}
+
+	if (!count) {
+		if (state->num_ciphers)
+			tlshd_log_error("None of the configured kTLS ciphers can be used; using the default order.");
+		return;
+	}
+	memcpy(state->order, order, count * sizeof(order[0]));
+	state->num_ciphers = count;
+}
+
+static void tlshd_ktls_measure(const struct tlshd_ktls_state *state)
+{
+	const struct tlshd_ktls_cipher *cipher;
+	unsigned int i;
+	uint64_t rate;
+
+	for (i = 0; i < state->num_ciphers; i++) {
+		cipher = state->order[i];
+		rate = tlshd_ktls_benchmark(cipher);
+		tlshd_ktls_rate[cipher - tlshd_ktls_ciphers] = rate;
+		if (rate)
+			tlshd_log_debug("kTLS %s: %llu MB/s", cipher->name,
+					(unsigned long long)rate / 1000000);
+		else
+			tlshd_log_debug("kTLS %s: could not be measured",
+					cipher->name);
+	}
+}
+
+/*
+ * Sort ciphers fastest-first according to measured throughput.
+ * Ciphers that perform the same, or that were not measured, keep
+ * their order of strength.
+ */
+static void tlshd_ktls_order_measured(struct tlshd_ktls_state *state)
+{
+	uint64_t rate[ARRAY_SIZE(tlshd_ktls_ciphers)];
+	const struct tlshd_ktls_cipher *cipher;
+	unsigned int i, j;
+	uint64_t tmp;
+
+	for (i = 0; i < state->num_ciphers; i++)
+		rate[i] = tlshd_ktls_rate[state->order[i] - tlshd_ktls_ciphers];
+
+	for (i = 1; i < state->num_ciphers; i++) {
+		cipher = state->order[i];
+		tmp = rate[i];
+		for (j = i; j > 0 && rate[j - 1] < tmp; j--) {
+			state->order[j] = state->order[j - 1];
+			rate[j] = rate[j - 1];
+		}
+		state->order[j] = cipher;
+		rate[j] = tmp;
+	}
+}
+
+/*
+ * Find out which ciphers the running kernel can actually install, so
+ * that a handshake never negotiates a cipher that kTLS will reject
+ * after all of the handshake's crypto work has been done.
+ */
+static void tlshd_ktls_probe(struct tlshd_ktls_state *state)
+{
+	unsigned int i, count = 0;
+	int sv[2];
+
+	for (i = 0; i < ARRAY_SIZE(tlshd_ktls_ciphers); i++) {
+		state->supported[i] = false;
+		if (!tlshd_ktls_loopback(sv))
+			continue;
+		if (tlshd_ktls_loopback_install(&tlshd_ktls_ciphers[i], sv)) {
+			state->supported[i] = true;
+			count++;
+		} else
+			tlshd_log_debug("The kernel does not support %s",
+					tlshd_ktls_ciphers[i].name);
+		close(sv[0]);
+		close(sv[1]);
+	}
+
+	if (!count)
+		tlshd_log_error("The kernel does not support kTLS; handshake requests will fail.");
+}
+
+/*
+ * Returns a value that changes whenever the tls module is loaded or
+ * unloaded. Other modules, and the tls module's use count, do not
+ * affect it.
+ */
+static guint tlshd_ktls_module_signature(void)
+{
+	char line[256], name[64], size[32], addr[32];
+	guint hash = 0;
+	const char *p;
+	FILE *fp;
+
+	fp = fopen("/proc/modules", "re");
+	if (!fp)
+		return 0;
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "%63s %31s %*s %*s %*s %31s",
+			   name, size, addr) != 3)
+			continue;
+		if (strcmp(name, "tls"))
+			continue;
+		hash = 5381;
+		for (p = size; *p; p++)
+			hash = hash * 33 + *p;
+		for (p = addr; *p; p++)
+			hash = hash * 33 + *p;
+		break;
 	}
+	fclose(fp);
+	return hash;
+}
 
-	return EIO;
+/*
+ * Throughput is measured only when @measure is true. Otherwise the
+ * rates measured at start-up are reused.
+ */
+static void tlshd_ktls_select(struct tlshd_ktls_state *state, bool measure)
+{
+	gsize i, length;
+	gchar **names;
+
+	tlshd_ktls_probe(state);
+
+	state->num_ciphers = 0;
+	for (i = 0; i < ARRAY_SIZE(tlshd_ktls_ciphers); i++)
+		if (state->supported[i])
+			state->order[state->num_ciphers++] =
+				&tlshd_ktls_ciphers[i];
+
+	names = tlshd_config_get_ktls_ciphers(&length);
+	if (names) {
+		tlshd_ktls_order_pinned(state, names, length);
+		g_strfreev(names);
+	} else if (tlshd_config_get_ktls_benchmark()) {
+		if (measure)
+			tlshd_ktls_measure(state);
+		tlshd_ktls_order_measured(state);
+	}
+
+	for (i = 0; i < state->num_ciphers; i++)
+		tlshd_log_debug("kTLS cipher preference %u: %s",
+				(unsigned int)i + 1, state->order[i]->name);
+}
+
+/**
+ * tlshd_ktls_init - Choose the kTLS ciphers to offer, and their order
+ *
+ */
+void tlshd_ktls_init(void)
+{
+	tlshd_ktls_module = tlshd_ktls_module_signature();
+	tlshd_ktls_select(&tlshd_ktls_states[0], true);
+}
+
+/**
+ * tlshd_ktls_available - Report whether any kTLS cipher can be used
+ *
+ */
+bool tlshd_ktls_available(void)
+{
+	return tlshd_ktls_state()->num_ciphers > 0;
+}
+
+static void *tlshd_ktls_reprobe(__attribute__ ((unused)) void *arg)
+{
+	struct tlshd_ktls_state *next;
+
+	next = tlshd_ktls_state() == &tlshd_ktls_states[0] ?
+		&tlshd_ktls_states[1] : &tlshd_ktls_states[0];
+	tlshd_ktls_select(next, false);
+	__atomic_store_n(&tlshd_ktls_current, next, __ATOMIC_RELEASE);
+	__atomic_store_n(&tlshd_ktls_probing, false, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+/**
+ * tlshd_ktls_refresh - Probe kTLS again if the tls module has changed
+ *
+ * Called before each handshake request is dispatched. The module
+ * list is examined at most once every TLSHD_KTLS_REFRESH_SECS. The
+ * probe itself runs on its own thread so that it never delays the
+ * dispatcher; requests dispatched meanwhile use the previous result.
+ */
+void tlshd_ktls_refresh(void)
+{
+	static time_t last_check;
+	struct timespec now;
+	pthread_attr_t attr;
+	pthread_t thread;
+	guint signature;
+	int ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (now.tv_sec - last_check < TLSHD_KTLS_REFRESH_SECS)
+		return;
+	last_check = now.tv_sec;
+
+	signature = tlshd_ktls_module_signature();
+	if (signature == tlshd_ktls_module)
+		return;
+	/* A probe that is still running is noticed again next time */
+	if (__atomic_exchange_n(&tlshd_ktls_probing, true, __ATOMIC_ACQUIRE))
+		return;
+	tlshd_ktls_module = signature;
+
+	tlshd_log_debug("The tls module has changed; probing kTLS again");
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&thread, &attr, tlshd_ktls_reprobe, NULL);
+	pthread_attr_destroy(&attr);
+	if (ret) {
+		errno = ret;
+		tlshd_log_perror("pthread_create");
+		__atomic_store_n(&tlshd_ktls_probing, false, __ATOMIC_RELEASE);
+	}
 }
 
 /**
@@ -303,6 +930,8 @@ int tlshd_initialize_ktls(gnutls_session_t session)
  */
 char *tlshd_make_priorities_string(struct tlshd_handshake_parms *parms)
 {
+	const struct tlshd_ktls_state *state = tlshd_ktls_state();
+	unsigned int i;
 	char *result;
 
 	result = malloc(1024);
@@ -314,35 +943,78 @@ char *tlshd_make_priorities_string(struct tlshd_handshake_parms *parms)
 	strcat(result, "SECURE256:+SECURE128:-COMP-ALL");
 
 	/* All kernel TLS consumers require TLS v1.3 or newer. */
-	strcat(result, ":-VERS-ALL:+VERS-TLS1.3:%NO_TICKETS");
-
-	/*
-	 * Handshakes must negotiate only ciphers that are supported
-	 * by kTLS. The list below contains the ciphers that are
-	 * common to both kTLS and GnuTLS (Linux v6.2, GnuTLS 3.8.0).
-	 *
-	 * List is ordered from cryptographically strongest to weakest.
-	 */
-	strcat(result, ":-CIPHER-ALL");
+	strcat(result, ":-VERS-ALL:+VERS-TLS1.3");
+	if (!tlshd_ticket_enabled(parms))
+		strcat(result, ":%NO_TICKETS");
 
-#if defined(TLS_CIPHER_CHACHA20_POLY1305)
-	strcat(result, ":+CHACHA20-POLY1305");
-#endif
-#if defined(TLS_CIPHER_AES_GCM_256)
-	strcat(result, ":+AES-256-GCM");
-#endif
-#if defined(TLS_CIPHER_AES_GCM_128)
-	strcat(result, ":+AES-128-GCM");
-#endif
-#if defined(TLS_CIPHER_AES_CCM_128)
-	strcat(result, ":+AES-128-CCM");
-#endif
+	/* Handshakes must negotiate only ciphers that are supported by kTLS */
+	strcat(result, ":-CIPHER-ALL");
+	for (i = 0; i < state->num_ciphers; i++) {
+		strcat(result, ":+");
+		strcat(result, state->order[i]->name);
+	}
 
 	switch (parms->auth_mode) {
 	case HANDSHAKE_AUTH_PSK:
 		strcat(result, ":+PSK:+DHE-PSK:+ECDHE-PSK");
 		break;
 	}
+	if (parms->rawpk)
+		strcat(result, ":-CTYPE-ALL:+CTYPE-RAWPK");
+
+	return result;
+}
+
+/**
+ * tlshd_prefer_group - Override the order of key exchange groups
+ * @priorities: NUL-terminated GnuTLS "priorities" string
+ * @group: key exchange group to place first
+ *
+ * Combined with GNUTLS_KEY_SHARE_TOP, the ClientHello then carries
+ * a key share for only @group.
+ *
+ * Returns a buffer containing a NUL-terminated string that must
+ * be freed with free(3), or NULL if @group is not permitted by
+ * @priorities.
+ */
+char *tlshd_prefer_group(const char *priorities, int group)
+{
+	const unsigned int *list;
+	gnutls_priority_t pcache;
+	char *result = NULL;
+	int i, count, ret;
+	size_t len;
+
+	ret = gnutls_priority_init(&pcache, priorities, NULL);
+	if (ret != GNUTLS_E_SUCCESS) {
+		tlshd_log_gnutls_error(ret);
+		return NULL;
+	}
+
+	count = gnutls_priority_group_list(pcache, &list);
+	for (i = 0; i < count; i++)
+		if (list[i] == (unsigned int)group)
+			break;
+	if (i == count)
+		goto out;
+
+	len = strlen(priorities) + sizeof(":-GROUP-ALL") +
+		(count + 1) * (sizeof(":+GROUP-") + 32);
+	result = malloc(len);
+	if (!result)
+		goto out;
+
+	strcpy(result, priorities);
+	strcat(result, ":-GROUP-ALL:+GROUP-");
+	strcat(result, gnutls_group_get_name(group));
+	for (i = 0; i < count; i++) {
+		if (list[i] == (unsigned int)group)
+			continue;
+		strcat(result, ":+GROUP-");
+		strcat(result, gnutls_group_get_name(list[i]));
+	}
 
+out:
+	gnutls_priority_deinit(pcache);
 	return result;
 }
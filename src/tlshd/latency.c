@@ -0,0 +1,488 @@
+/*
+ * Record how long each phase of a handshake request takes.
+ *
+ * Copyright (c) 2023 Oracle and/or its affiliates.
+ *
+ * ktls-utils is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <keyutils.h>
+
+#include <gnutls/gnutls.h>
+#include <gnutls/abstract.h>
+
+#include <glib.h>
+
+#include "tlshd.h"
+#include "netlink.h"
+
+/*
+ * Each histogram is log-linear, in the manner of an HDR histogram:
+ * every power-of-two range of microseconds is split into
+ * TLSHD_LATENCY_SUB_BUCKETS equal buckets, so a recorded value is
+ * accurate to within 1/16th. Values of 2^32 usec (about 71 minutes)
+ * or more land in the last bucket.
+ */
+#define TLSHD_LATENCY_SUB_BITS		(4)
+#define TLSHD_LATENCY_SUB_BUCKETS	(1U << TLSHD_LATENCY_SUB_BITS)
+#define TLSHD_LATENCY_MAX_BITS		(32)
+#define TLSHD_LATENCY_BUCKETS		\
+	((TLSHD_LATENCY_MAX_BITS - TLSHD_LATENCY_SUB_BITS + 1) * \
+	 TLSHD_LATENCY_SUB_BUCKETS)
+
+#define TLSHD_LATENCY_AUTH_MODES	(HANDSHAKE_AUTH_X509 + 1)
+#define TLSHD_LATENCY_HANDSHAKE_TYPES	(HANDSHAKE_MSG_TYPE_SERVERHELLO + 1)
+
+/* Requests beyond this many at once are not listed as in flight */
+#define TLSHD_LATENCY_IN_FLIGHT		(256)
+
+struct tlshd_histogram {
+	uint64_t		count;
+	uint64_t		sum;
+	uint64_t		max;
+	uint64_t		buckets[TLSHD_LATENCY_BUCKETS];
+};
+
+/*
+ * Like the counters in stats.c, the histograms live in an anonymous
+ * shared mapping created by the parent before any children are
+ * forked. Pages for combinations that never occur are not touched.
+ */
+/*
+ * A child claims an in-flight entry by swapping its PID into @pid,
+ * and clears @pid when it finishes. @phase is the last phase the
+ * request completed; @peer is valid once that is at least
+ * TLSHD_PHASE_PEERNAME. Entries left by children that died are
+ * reclaimed by the reader.
+ */
+struct tlshd_in_flight {
+	pid_t			pid;
+	int			handshake_type;
+	int			auth_mode;
+	int			phase;
+	uint64_t		started_ns;
+	char			peer[64];
+};
+
+struct tlshd_latency {
+	struct tlshd_histogram	hist[TLSHD_PHASE_MAX]
+				    [TLSHD_LATENCY_AUTH_MODES]
+				    [TLSHD_LATENCY_HANDSHAKE_TYPES];
+	struct tlshd_in_flight	in_flight[TLSHD_LATENCY_IN_FLIGHT];
+};
+
+static struct tlshd_latency *tlshd_latency;
+
+/* The in-flight entry claimed by this handshake child */
+static struct tlshd_in_flight *tlshd_latency_entry;
+
+static const char *tlshd_phase_names[TLSHD_PHASE_MAX] = {
+	[TLSHD_PHASE_ACCEPT]		= "accept",
+	[TLSHD_PHASE_PEERNAME]		= "getpeername",
+	[TLSHD_PHASE_LOOKUP]		= "lookup",
+	[TLSHD_PHASE_CREDENTIALS]	= "credentials",
+	[TLSHD_PHASE_HANDSHAKE]		= "handshake",
+	[TLSHD_PHASE_KTLS]		= "ktls",
+	[TLSHD_PHASE_DONE]		= "done",
+	[TLSHD_PHASE_TOTAL]		= "total",
+};
+
+static const char *tlshd_latency_auth_names[TLSHD_LATENCY_AUTH_MODES] = {
+	[HANDSHAKE_AUTH_UNSPEC]		= "unspec",
+	[HANDSHAKE_AUTH_UNAUTH]		= "unauth",
+	[HANDSHAKE_AUTH_PSK]		= "psk",
+	[HANDSHAKE_AUTH_X509]		= "x509",
+};
+
+static const char *tlshd_latency_type_names[TLSHD_LATENCY_HANDSHAKE_TYPES] = {
+	[HANDSHAKE_MSG_TYPE_UNSPEC]	= "unspec",
+	[HANDSHAKE_MSG_TYPE_CLIENTHELLO] = "client",
+	[HANDSHAKE_MSG_TYPE_SERVERHELLO] = "server",
+};
+
+static unsigned int tlshd_latency_bucket(uint64_t usec)
+{
+	unsigned int shift;
+
+	if (usec < 2 * TLSHD_LATENCY_SUB_BUCKETS)
+		return usec;
+	if (usec >> TLSHD_LATENCY_MAX_BITS)
+		return TLSHD_LATENCY_BUCKETS - 1;
+
+	shift = 63 - __builtin_clzll(usec) - TLSHD_LATENCY_SUB_BITS;
+	return (shift + 1) * TLSHD_LATENCY_SUB_BUCKETS +
+		((usec >> shift) & (TLSHD_LATENCY_SUB_BUCKETS - 1));
+}
+
+/* Largest value that is counted in @bucket */
+static uint64_t tlshd_latency_bucket_limit(unsigned int bucket)
+{
+	unsigned int shift;
+
+	if (bucket < 2 * TLSHD_LATENCY_SUB_BUCKETS)
+		return bucket;
+
+	shift = bucket / TLSHD_LATENCY_SUB_BUCKETS - 1;
+	return ((uint64_t)(TLSHD_LATENCY_SUB_BUCKETS +
+			   bucket % TLSHD_LATENCY_SUB_BUCKETS + 1) << shift) - 1;
+}
+
+static uint64_t tlshd_latency_now_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void tlshd_latency_record(struct tlshd_histogram *hist, uint64_t usec)
+{
+	uint64_t max;
+
+	__atomic_fetch_add(&hist->buckets[tlshd_latency_bucket(usec)], 1,
+			   __ATOMIC_RELAXED);
+	__atomic_fetch_add(&hist->sum, usec, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
+
+	max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+	while (usec > max &&
+	       !__atomic_compare_exchange_n(&hist->max, &max, usec, true,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+/**
+ * tlshd_latency_percentile - Estimate a percentile from a histogram
+ * @hist: histogram to read
+ * @permille: which percentile, in tenths of a percent
+ *
+ * Returns the largest value that could have been recorded in the
+ * bucket holding the requested percentile, or the largest value
+ * actually recorded, whichever is smaller.
+ */
+static uint64_t tlshd_latency_percentile(const struct tlshd_histogram *hist,
+					 unsigned int permille)
+{
+	uint64_t count, target, max, seen = 0;
+	unsigned int i;
+
+	count = __atomic_load_n(&hist->count, __ATOMIC_RELAXED);
+	max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+	target = (count * permille + 999) / 1000;
+	for (i = 0; i < TLSHD_LATENCY_BUCKETS; i++) {
+		seen += __atomic_load_n(&hist->buckets[i], __ATOMIC_RELAXED);
+		if (seen >= target)
+			return MIN(tlshd_latency_bucket_limit(i), max);
+	}
+	return max;
+}
+
+/**
+ * tlshd_latency_init - Create the shared histogram area
+ *
+ */
+void tlshd_latency_init(void)
+{
+	tlshd_latency = mmap(NULL, sizeof(*tlshd_latency),
+			     PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (tlshd_latency == MAP_FAILED) {
+		tlshd_log_perror("mmap");
+		tlshd_latency = NULL;
+	}
+}
+
+/**
+ * tlshd_latency_shutdown - Report and release the histogram area
+ *
+ */
+void tlshd_latency_shutdown(void)
+{
+	const struct tlshd_histogram *hist;
+	unsigned int phase, mode, type;
+
+	if (!tlshd_latency)
+		return;
+
+	for (phase = 0; phase < TLSHD_PHASE_MAX; phase++)
+		for (mode = 0; mode < TLSHD_LATENCY_AUTH_MODES; mode++)
+			for (type = 0; type < TLSHD_LATENCY_HANDSHAKE_TYPES; type++) {
+				hist = &tlshd_latency->hist[phase][mode][type];
+				if (!hist->count)
+					continue;
+				tlshd_log_debug("%s latency (%s %s): count %llu, mean %llu, p50 %llu, p90 %llu, p99 %llu, max %llu usec",
+						tlshd_phase_names[phase],
+						tlshd_latency_auth_names[mode],
+						tlshd_latency_type_names[type],
+						(unsigned long long)hist->count,
+						(unsigned long long)(hist->sum / hist->count),
+						(unsigned long long)tlshd_latency_percentile(hist, 500),
+						(unsigned long long)tlshd_latency_percentile(hist, 900),
+						(unsigned long long)tlshd_latency_percentile(hist, 990),
+						(unsigned long long)hist->max);
+			}
+
+	munmap(tlshd_latency, sizeof(*tlshd_latency));
+	tlshd_latency = NULL;
+}
+
+static void tlshd_latency_write_histogram(FILE *f, const char *labels,
+					  const struct tlshd_histogram *hist)
+{
+	uint64_t cumulative = 0;
+	unsigned int i;
+
+	/* One bucket boundary per power of two keeps the output compact */
+	for (i = 0; i < TLSHD_LATENCY_BUCKETS; i++) {
+		cumulative += __atomic_load_n(&hist->buckets[i],
+					      __ATOMIC_RELAXED);
+		if (i < 2 * TLSHD_LATENCY_SUB_BUCKETS - 1 ||
+		    i % TLSHD_LATENCY_SUB_BUCKETS != TLSHD_LATENCY_SUB_BUCKETS - 1 ||
+		    i == TLSHD_LATENCY_BUCKETS - 1)
+			continue;
+		fprintf(f, "tlshd_phase_duration_seconds_bucket{%s,le=\"%.6f\"} %llu\n",
+			labels, tlshd_latency_bucket_limit(i) / 1e6,
+			(unsigned long long)cumulative);
+	}
+	fprintf(f, "tlshd_phase_duration_seconds_bucket{%s,le=\"+Inf\"} %llu\n",
+		labels, (unsigned long long)cumulative);
+	fprintf(f, "tlshd_phase_duration_seconds_sum{%s} %.6f\n", labels,
+		__atomic_load_n(&hist->sum, __ATOMIC_RELAXED) / 1e6);
+	fprintf(f, "tlshd_phase_duration_seconds_count{%s} %llu\n", labels,
+		(unsigned long long)cumulative);
+}
+
+/**
+ * tlshd_latency_write_metrics - Emit histograms in Prometheus text format
+ * @f: stream to write to
+ *
+ */
+void tlshd_latency_write_metrics(FILE *f)
+{
+	const struct tlshd_histogram *hist;
+	unsigned int phase, mode, type;
+	char labels[64];
+
+	if (!tlshd_latency)
+		return;
+
+	fprintf(f, "# TYPE tlshd_phase_duration_seconds histogram\n");
+	for (phase = 0; phase < TLSHD_PHASE_MAX; phase++)
+		for (mode = 0; mode < TLSHD_LATENCY_AUTH_MODES; mode++)
+			for (type = 0; type < TLSHD_LATENCY_HANDSHAKE_TYPES; type++) {
+				hist = &tlshd_latency->hist[phase][mode][type];
+				if (!__atomic_load_n(&hist->count, __ATOMIC_RELAXED))
+					continue;
+				snprintf(labels, sizeof(labels),
+					 "phase=\"%s\",auth=\"%s\",type=\"%s\"",
+					 tlshd_phase_names[phase],
+					 tlshd_latency_auth_names[mode],
+					 tlshd_latency_type_names[type]);
+				tlshd_latency_write_histogram(f, labels, hist);
+			}
+}
+
+/**
+ * tlshd_latency_start - Note the arrival of a handshake request
+ * @parms: handshake parameters
+ *
+ */
+void tlshd_latency_start(struct tlshd_handshake_parms *parms)
+{
+	struct tlshd_in_flight *entry;
+	pid_t expected, pid;
+	unsigned int i;
+
+	parms->started_ns = tlshd_latency_now_ns();
+	parms->phase_ns = parms->started_ns;
+
+	tlshd_latency_entry = NULL;
+	if (!tlshd_latency)
+		return;
+	pid = getpid();
+	for (i = 0; i < TLSHD_LATENCY_IN_FLIGHT; i++) {
+		entry = &tlshd_latency->in_flight[i];
+		expected = 0;
+		if (__atomic_compare_exchange_n(&entry->pid, &expected, pid,
+						false, __ATOMIC_ACQUIRE,
+						__ATOMIC_RELAXED))
+			break;
+	}
+	if (i == TLSHD_LATENCY_IN_FLIGHT)
+		return;
+
+	entry->started_ns = parms->started_ns;
+	entry->handshake_type = HANDSHAKE_MSG_TYPE_UNSPEC;
+	entry->auth_mode = HANDSHAKE_AUTH_UNSPEC;
+	entry->peer[0] = '\0';
+	__atomic_store_n(&entry->phase, -1, __ATOMIC_RELEASE);
+	tlshd_latency_entry = entry;
+}
+
+static void tlshd_latency_track(const struct tlshd_handshake_parms *parms,
+				enum tlshd_phase phase)
+{
+	struct tlshd_in_flight *entry = tlshd_latency_entry;
+
+	/* The entry is released by tlshd_latency_finish() */
+	if (!entry || phase == TLSHD_PHASE_DONE)
+		return;
+
+	entry->handshake_type = parms->handshake_type;
+	entry->auth_mode = parms->auth_mode;
+	if (phase == TLSHD_PHASE_PEERNAME && parms->peeraddr_text)
+		snprintf(entry->peer, sizeof(entry->peer), "%s",
+			 parms->peeraddr_text);
+	__atomic_store_n(&entry->phase, phase, __ATOMIC_RELEASE);
+}
+
+/**
+ * tlshd_latency_finish - Note that a handshake request is done
+ *
+ * Releases the in-flight entry claimed by tlshd_latency_start(),
+ * whether or not the request got far enough to be measured.
+ */
+void tlshd_latency_finish(void)
+{
+	struct tlshd_in_flight *entry = tlshd_latency_entry;
+
+	if (!entry)
+		return;
+	__atomic_store_n(&entry->pid, 0, __ATOMIC_RELEASE);
+	tlshd_latency_entry = NULL;
+}
+
+/**
+ * tlshd_latency_phase_name - Name a handshake phase
+ * @phase: phase to name
+ *
+ */
+const char *tlshd_latency_phase_name(enum tlshd_phase phase)
+{
+	return tlshd_phase_names[phase];
+}
+
+/**
+ * tlshd_latency_mark - Record the end of a handshake phase
+ * @parms: handshake parameters
+ * @phase: the phase that has just finished
+ *
+ * The phase is taken to have started when the previous phase ended.
+ * Completing %TLSHD_PHASE_DONE also records the request's total
+ * service time. @phase is saved in @parms so that failures can be
+ * attributed to the phase that follows it.
+ */
+void tlshd_latency_mark(struct tlshd_handshake_parms *parms,
+			enum tlshd_phase phase)
+{
+	unsigned int mode, type;
+	uint64_t now;
+
+	now = tlshd_latency_now_ns();
+	if (!tlshd_latency)
+		goto out;
+
+	mode = parms->auth_mode;
+	if (mode >= TLSHD_LATENCY_AUTH_MODES)
+		mode = HANDSHAKE_AUTH_UNSPEC;
+	type = parms->handshake_type;
+	if (type >= TLSHD_LATENCY_HANDSHAKE_TYPES)
+		type = HANDSHAKE_MSG_TYPE_UNSPEC;
+
+	tlshd_latency_record(&tlshd_latency->hist[phase][mode][type],
+			     (now - parms->phase_ns) / 1000);
+	if (phase == TLSHD_PHASE_DONE)
+		tlshd_latency_record(&tlshd_latency->hist[TLSHD_PHASE_TOTAL][mode][type],
+				     (now - parms->started_ns) / 1000);
+out:
+	parms->phase_durations_ns[phase] = now - parms->phase_ns;
+	if (phase == TLSHD_PHASE_DONE)
+		parms->phase_durations_ns[TLSHD_PHASE_TOTAL] =
+			now - parms->started_ns;
+	parms->phase_ns = now;
+	parms->phase = phase;
+	tlshd_latency_track(parms, phase);
+}
+
+/**
+ * tlshd_latency_write_in_flight - List the requests being serviced
+ * @f: stream to write to
+ *
+ * Each line shows a handshake child's PID, the request's handshake
+ * type and authentication mode, the last phase it completed, how
+ * long ago it arrived, and the peer's address once it is known.
+ */
+void tlshd_latency_write_in_flight(FILE *f)
+{
+	struct tlshd_in_flight *entry;
+	unsigned int i, count = 0;
+	uint64_t now, started;
+	int phase, type, mode;
+	char peer[64];
+	pid_t pid;
+
+	if (!tlshd_latency)
+		return;
+
+	now = tlshd_latency_now_ns();
+	for (i = 0; i < TLSHD_LATENCY_IN_FLIGHT; i++) {
+		entry = &tlshd_latency->in_flight[i];
+		pid = __atomic_load_n(&entry->pid, __ATOMIC_ACQUIRE);
+		if (!pid)
+			continue;
+		if (kill(pid, 0) == -1 && errno == ESRCH) {
+			__atomic_compare_exchange_n(&entry->pid, &pid, 0, false,
+						    __ATOMIC_RELAXED,
+						    __ATOMIC_RELAXED);
+			continue;
+		}
+
+		phase = __atomic_load_n(&entry->phase, __ATOMIC_ACQUIRE);
+		started = entry->started_ns;
+		type = entry->handshake_type;
+		mode = entry->auth_mode;
+		peer[0] = '\0';
+		if (phase >= TLSHD_PHASE_PEERNAME)
+			snprintf(peer, sizeof(peer), "%s", entry->peer);
+		if (type < 0 || type >= TLSHD_LATENCY_HANDSHAKE_TYPES)
+			type = HANDSHAKE_MSG_TYPE_UNSPEC;
+		if (mode < 0 || mode >= TLSHD_LATENCY_AUTH_MODES)
+			mode = HANDSHAKE_AUTH_UNSPEC;
+
+		fprintf(f, "pid %d: %s %s, after %s, %llu msec, peer %s\n",
+			(int)pid, tlshd_latency_type_names[type],
+			tlshd_latency_auth_names[mode],
+			phase >= 0 && phase < TLSHD_PHASE_MAX ?
+				tlshd_phase_names[phase] : "upcall",
+			(unsigned long long)((now - started) / 1000000),
+			peer[0] ? peer : "unknown");
+		count++;
+	}
+	fprintf(f, "%u request(s) in flight\n", count);
+}
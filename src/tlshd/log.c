@@ -21,13 +21,20 @@
 #include "config.h"
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <unistd.h>
 #include <string.h>
 #include <syslog.h>
 #include <stdarg.h>
+#include <time.h>
 #include <errno.h>
+#include <poll.h>
+#include <pthread.h>
 
 #include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
 #include <netdb.h>
 #include <keyutils.h>
 
@@ -44,41 +51,499 @@ int tlshd_debug;
 int tlshd_tls_debug;
 int tlshd_stderr;
 
+/* Must be a power of two */
+#define TLSHD_LOG_RING_RECORDS	(1024)
+
+#define TLSHD_LOG_TEXT_SIZE	(496)
+
+#define TLSHD_LOG_CACHELINE	(64)
+
+/* How often the drain thread reports suppressed messages */
+#define TLSHD_LOG_SUMMARY_SECS	(10)
+
+#define TLSHD_LOG_NSEC_PER_SEC	(1000000000ULL)
+
+/* How long a claimed record may remain unpublished before it is skipped */
+#define TLSHD_LOG_CLAIM_TIMEOUT_MS	(1000)
+
+/*
+ * A failing peer that retries in a tight loop produces the same few
+ * messages over and over. These classes of message are rate limited
+ * so that a failure storm cannot flood the system log; the events
+ * behind them are still counted exactly in the statistics.
+ */
+enum tlshd_log_class {
+	TLSHD_LOG_FAILURE,
+	TLSHD_LOG_CERT,
+	TLSHD_LOG_GNUTLS,
+	TLSHD_LOG_TRACE,
+
+	TLSHD_LOG_CLASSES
+};
+
+static const struct {
+	const char		*name;
+	enum tlshd_stat		stat;
+} tlshd_log_classes[TLSHD_LOG_CLASSES] = {
+	[TLSHD_LOG_FAILURE]	= {
+		.name		= "handshake failure",
+		.stat		= TLSHD_STAT_LOG_SUPPRESSED_FAILURE,
+	},
+	[TLSHD_LOG_CERT]	= {
+		.name		= "certificate verification",
+		.stat		= TLSHD_STAT_LOG_SUPPRESSED_CERT,
+	},
+	[TLSHD_LOG_GNUTLS]	= {
+		.name		= "TLS library error",
+		.stat		= TLSHD_STAT_LOG_SUPPRESSED_GNUTLS,
+	},
+	[TLSHD_LOG_TRACE]	= {
+		.name		= "GnuTLS trace",
+		.stat		= TLSHD_STAT_LOG_SUPPRESSED_TRACE,
+	},
+};
+
+/*
+ * Each class is limited by the generic cell rate algorithm, which
+ * is a token bucket whose whole state is one timestamp, @tat: the
+ * time at which the bucket would be full again. A message is let
+ * through if @tat is no further ahead of now than the burst allows,
+ * and advances @tat by one emission interval. That makes the check
+ * a single compare-and-swap, so it can be shared by every process.
+ *
+ * The most recently suppressed message is kept as a sample for the
+ * periodic summary. @sample_busy is a try-lock; a writer that finds
+ * it taken does not wait.
+ */
+struct tlshd_log_limit {
+	uint64_t		tat;
+	uint64_t		suppressed;
+	int			sample_busy;
+	char			sample[TLSHD_LOG_TEXT_SIZE];
+} __attribute__ ((aligned(TLSHD_LOG_CACHELINE)));
+
+/*
+ * A record is free for the producer that claims position @pos when
+ * @seq equals @pos, and is ready for the drain thread when @seq
+ * equals @pos + 1.
+ */
+struct tlshd_log_record {
+	uint64_t		seq;
+	int			priority;
+	pid_t			pid;
+	char			text[TLSHD_LOG_TEXT_SIZE];
+};
+
+struct tlshd_log_ring {
+	uint64_t		head __attribute__ ((aligned(TLSHD_LOG_CACHELINE)));
+	uint64_t		tail __attribute__ ((aligned(TLSHD_LOG_CACHELINE)));
+	uint64_t		dropped;
+	int			sleeping;
+	uint64_t		interval_ns;
+	uint64_t		tolerance_ns;
+	struct tlshd_log_limit	limits[TLSHD_LOG_CLASSES];
+	struct tlshd_log_record	records[TLSHD_LOG_RING_RECORDS];
+};
+
+/*
+ * Writing to /dev/log blocks whenever the journal falls behind, so
+ * messages are not sent from the handshake path. Instead, every
+ * process appends preformatted records to a ring in an anonymous
+ * shared mapping, and a thread in the parent passes them on to
+ * syslog(3). When the ring is full, new records are dropped and
+ * counted rather than waited for.
+ *
+ * Messages are formatted before a record is claimed, so a child
+ * holds a claimed record only for the duration of a memcpy. A child
+ * killed in that window leaves a record that is never published. The
+ * drain thread waits TLSHD_LOG_CLAIM_TIMEOUT_MS for such a record,
+ * then releases it unread and counts it as dropped.
+ */
+static struct tlshd_log_ring *tlshd_log_ring;
+static int tlshd_log_wakeup = -1;
+static pthread_t tlshd_log_thread;
+static pid_t tlshd_log_pid;
+static bool tlshd_log_stopping;
+
+/* Used only by the drain thread */
+static uint64_t tlshd_log_stalled_pos = UINT64_MAX;
+static uint64_t tlshd_log_stalled_since;
+
+static bool tlshd_log_append(int priority, const char *text)
+{
+	struct tlshd_log_ring *ring = tlshd_log_ring;
+	struct tlshd_log_record *record;
+	uint64_t pos, seq, claimed;
+
+	pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	while (true) {
+		record = &ring->records[pos & (TLSHD_LOG_RING_RECORDS - 1)];
+		seq = __atomic_load_n(&record->seq, __ATOMIC_ACQUIRE);
+		if (seq == pos) {
+			if (__atomic_compare_exchange_n(&ring->head, &pos,
+							pos + 1, true,
+							__ATOMIC_RELAXED,
+							__ATOMIC_RELAXED))
+				break;
+		} else if ((int64_t)(seq - pos) < 0)
+			return false;
+		else
+			pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	}
+
+	record->priority = priority;
+	record->pid = getpid();
+	strcpy(record->text, text);
+
+	/* Fails only if the drain thread already gave up on this record */
+	claimed = pos;
+	if (!__atomic_compare_exchange_n(&record->seq, &claimed, pos + 1,
+					 false, __ATOMIC_RELEASE,
+					 __ATOMIC_RELAXED))
+		return true;
+
+	/* Pairs with the sleeping/recheck sequence in tlshd_log_drain() */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ring->sleeping, __ATOMIC_RELAXED) &&
+	    __atomic_exchange_n(&ring->sleeping, 0, __ATOMIC_RELAXED))
+		eventfd_write(tlshd_log_wakeup, 1);
+	return true;
+}
+
+static uint64_t tlshd_log_now_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * TLSHD_LOG_NSEC_PER_SEC + now.tv_nsec;
+}
+
+static bool tlshd_log_limited(enum tlshd_log_class class, const char *text)
+{
+	struct tlshd_log_ring *ring = tlshd_log_ring;
+	struct tlshd_log_limit *limit = &ring->limits[class];
+	uint64_t now, tat, next;
+
+	if (!ring->interval_ns)
+		return false;
+
+	now = tlshd_log_now_ns();
+	tat = __atomic_load_n(&limit->tat, __ATOMIC_RELAXED);
+	do {
+		if (tat > now && tat - now > ring->tolerance_ns)
+			goto suppress;
+		next = (tat > now ? tat : now) + ring->interval_ns;
+	} while (!__atomic_compare_exchange_n(&limit->tat, &tat, next, true,
+					      __ATOMIC_RELAXED,
+					      __ATOMIC_RELAXED));
+	return false;
+
+suppress:
+	__atomic_fetch_add(&limit->suppressed, 1, __ATOMIC_RELAXED);
+	tlshd_stats_inc(tlshd_log_classes[class].stat);
+	if (!__atomic_exchange_n(&limit->sample_busy, 1, __ATOMIC_ACQUIRE)) {
+		strcpy(limit->sample, text);
+		__atomic_store_n(&limit->sample_busy, 0, __ATOMIC_RELEASE);
+	}
+	return true;
+}
+
+/*
+ * @class is a tlshd_log_class, or -1 for messages that are never
+ * rate limited. Returns false if the message was suppressed.
+ */
+static bool tlshd_log_vsyslog_class(int class, int priority, const char *fmt,
+				    va_list args)
+{
+	char text[TLSHD_LOG_TEXT_SIZE];
+
+	if (!tlshd_log_ring) {
+		vsyslog(priority, fmt, args);
+		return true;
+	}
+
+	vsnprintf(text, sizeof(text), fmt, args);
+	if (class >= 0 && tlshd_log_limited(class, text))
+		return false;
+	if (!tlshd_log_append(priority, text)) {
+		__atomic_fetch_add(&tlshd_log_ring->dropped, 1,
+				   __ATOMIC_RELAXED);
+		tlshd_stats_inc(TLSHD_STAT_LOG_DROPPED);
+	}
+	return true;
+}
+
+static void tlshd_log_vsyslog(int priority, const char *fmt, va_list args)
+{
+	tlshd_log_vsyslog_class(-1, priority, fmt, args);
+}
+
+static void tlshd_log_syslog(int priority, const char *fmt, ...)
+	__attribute__ ((format (printf, 2, 3)));
+
+static void tlshd_log_syslog(int priority, const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	tlshd_log_vsyslog(priority, fmt, args);
+	va_end(args);
+}
+
+static void tlshd_log_limited_syslog(enum tlshd_log_class class,
+				     int priority, const char *fmt, ...)
+	__attribute__ ((format (printf, 3, 4)));
+
+static void tlshd_log_limited_syslog(enum tlshd_log_class class,
+				     int priority, const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	tlshd_log_vsyslog_class(class, priority, fmt, args);
+	va_end(args);
+}
+
+/*
+ * Release the record at @pos if its producer has held it unpublished
+ * for too long. Returns true if the record was released.
+ */
+static bool tlshd_log_skip_stalled(struct tlshd_log_record *record,
+				   uint64_t pos)
+{
+	uint64_t now = tlshd_log_now_ns();
+	uint64_t claimed = pos;
+
+	if (tlshd_log_stalled_pos != pos) {
+		tlshd_log_stalled_pos = pos;
+		tlshd_log_stalled_since = now;
+		return false;
+	}
+	if (now - tlshd_log_stalled_since <
+	    TLSHD_LOG_CLAIM_TIMEOUT_MS * 1000000ULL)
+		return false;
+
+	/* Pairs with the publishing compare-and-swap in tlshd_log_append() */
+	if (!__atomic_compare_exchange_n(&record->seq, &claimed,
+					 pos + TLSHD_LOG_RING_RECORDS, false,
+					 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		return false;
+
+	__atomic_fetch_add(&tlshd_log_ring->dropped, 1, __ATOMIC_RELAXED);
+	tlshd_stats_inc(TLSHD_STAT_LOG_DROPPED);
+	return true;
+}
+
+/*
+ * Pass on every record that is ready, and skip any record whose
+ * producer has abandoned it. Returns false if no record was removed.
+ */
+static bool tlshd_log_drain_ready(void)
+{
+	struct tlshd_log_ring *ring = tlshd_log_ring;
+	struct tlshd_log_record *record;
+	bool drained = false;
+	uint64_t pos, seq;
+
+	while (true) {
+		pos = ring->tail;
+		record = &ring->records[pos & (TLSHD_LOG_RING_RECORDS - 1)];
+		seq = __atomic_load_n(&record->seq, __ATOMIC_ACQUIRE);
+		if (seq != pos + 1) {
+			/* Claimed but unpublished if head has moved past it */
+			if (seq != pos ||
+			    __atomic_load_n(&ring->head, __ATOMIC_RELAXED) == pos ||
+			    !tlshd_log_skip_stalled(record, pos))
+				break;
+			ring->tail = pos + 1;
+			drained = true;
+			continue;
+		}
+
+		/* LOG_PID shows the parent's PID, so name the sender */
+		if (record->pid == tlshd_log_pid)
+			syslog(record->priority, "%s", record->text);
+		else
+			syslog(record->priority, "[%d] %s", record->pid,
+			       record->text);
+
+		__atomic_store_n(&record->seq, pos + TLSHD_LOG_RING_RECORDS,
+				 __ATOMIC_RELEASE);
+		ring->tail = pos + 1;
+		drained = true;
+	}
+	return drained;
+}
+
+/*
+ * Report how many messages of each class were suppressed since the
+ * last summary, along with the most recent of them.
+ */
+static void tlshd_log_summarize(void)
+{
+	struct tlshd_log_limit *limit;
+	char sample[TLSHD_LOG_TEXT_SIZE];
+	uint64_t suppressed;
+	unsigned int i;
+
+	for (i = 0; i < TLSHD_LOG_CLASSES; i++) {
+		limit = &tlshd_log_ring->limits[i];
+		suppressed = __atomic_exchange_n(&limit->suppressed, 0,
+						 __ATOMIC_RELAXED);
+		if (!suppressed)
+			continue;
+
+		sample[0] = '\0';
+		if (!__atomic_exchange_n(&limit->sample_busy, 1,
+					 __ATOMIC_ACQUIRE)) {
+			strcpy(sample, limit->sample);
+			__atomic_store_n(&limit->sample_busy, 0,
+					 __ATOMIC_RELEASE);
+		}
+		syslog(LOG_NOTICE, "Suppressed %llu more %s messages%s%s",
+		       (unsigned long long)suppressed,
+		       tlshd_log_classes[i].name,
+		       sample[0] ? ", most recently: " : "", sample);
+	}
+}
+
+static void *tlshd_log_drain(__attribute__ ((unused)) void *arg)
+{
+	struct tlshd_log_ring *ring = tlshd_log_ring;
+	struct pollfd pfd = {
+		.fd		= tlshd_log_wakeup,
+		.events		= POLLIN,
+	};
+	uint64_t dropped, reported = 0;
+	uint64_t now, next_summary;
+	eventfd_t count;
+	bool drained;
+	int timeout;
+
+	next_summary = tlshd_log_now_ns() +
+		TLSHD_LOG_SUMMARY_SECS * TLSHD_LOG_NSEC_PER_SEC;
+	while (true) {
+		drained = tlshd_log_drain_ready();
+
+		now = tlshd_log_now_ns();
+		if (now >= next_summary) {
+			tlshd_log_summarize();
+			next_summary = now +
+				TLSHD_LOG_SUMMARY_SECS * TLSHD_LOG_NSEC_PER_SEC;
+		}
+		if (drained)
+			continue;
+
+		dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+		if (dropped != reported) {
+			syslog(LOG_WARNING, "%llu log messages dropped",
+			       (unsigned long long)(dropped - reported));
+			reported = dropped;
+		}
+		if (__atomic_load_n(&tlshd_log_stopping, __ATOMIC_ACQUIRE)) {
+			tlshd_log_summarize();
+			break;
+		}
+
+		__atomic_store_n(&ring->sleeping, 1, __ATOMIC_SEQ_CST);
+		if (tlshd_log_drain_ready()) {
+			__atomic_store_n(&ring->sleeping, 0, __ATOMIC_RELAXED);
+			continue;
+		}
+		/* Come back for a stalled record even if nothing else arrives */
+		timeout = tlshd_log_stalled_pos == ring->tail ?
+			TLSHD_LOG_CLAIM_TIMEOUT_MS :
+			TLSHD_LOG_SUMMARY_SECS * 1000;
+		if (poll(&pfd, 1, timeout) > 0)
+			eventfd_read(tlshd_log_wakeup, &count);
+		__atomic_store_n(&ring->sleeping, 0, __ATOMIC_RELAXED);
+	}
+	return NULL;
+}
+
+static void tlshd_log_ring_init(void)
+{
+	struct tlshd_log_ring *ring;
+	unsigned int i;
+	int ret;
+
+	ring = mmap(NULL, sizeof(*ring), PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (ring == MAP_FAILED) {
+		syslog(LOG_NOTICE, "mmap: %s\n", strerror(errno));
+		return;
+	}
+	for (i = 0; i < TLSHD_LOG_RING_RECORDS; i++)
+		ring->records[i].seq = i;
+
+	tlshd_log_wakeup = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (tlshd_log_wakeup < 0) {
+		syslog(LOG_NOTICE, "eventfd: %s\n", strerror(errno));
+		goto out_unmap;
+	}
+
+	tlshd_log_ring = ring;
+	tlshd_log_pid = getpid();
+	ret = pthread_create(&tlshd_log_thread, NULL, tlshd_log_drain, NULL);
+	if (ret) {
+		tlshd_log_ring = NULL;
+		syslog(LOG_NOTICE, "pthread_create: %s\n", strerror(ret));
+		goto out_close;
+	}
+	return;
+
+out_close:
+	close(tlshd_log_wakeup);
+	tlshd_log_wakeup = -1;
+out_unmap:
+	munmap(ring, sizeof(*ring));
+}
+
+static void tlshd_log_ring_shutdown(void)
+{
+	struct tlshd_log_ring *ring = tlshd_log_ring;
+
+	if (!ring)
+		return;
+
+	__atomic_store_n(&tlshd_log_stopping, true, __ATOMIC_RELEASE);
+	if (eventfd_write(tlshd_log_wakeup, 1) == 0)
+		pthread_join(tlshd_log_thread, NULL);
+
+	/* Children still running keep their own mapping */
+	tlshd_log_ring = NULL;
+	close(tlshd_log_wakeup);
+	tlshd_log_wakeup = -1;
+	munmap(ring, sizeof(*ring));
+}
+
 /**
  * tlshd_log_success - Emit "handshake successful" notification
  * @hostname: peer's DNS name
- * @sap: peer's IP address
- * @salen: length of IP address
+ * @addr: peer's IP address, in presentation format
  *
  */
-void tlshd_log_success(const char *hostname, const struct sockaddr *sap,
-		       socklen_t salen)
+void tlshd_log_success(const char *hostname, const char *addr)
 {
-	char buf[NI_MAXHOST];
-
-	getnameinfo(sap, salen, buf, sizeof(buf), NULL, 0, NI_NUMERICHOST);
-	syslog(LOG_INFO, "Handshake with %s (%s) was successful\n",
-		hostname, buf);
+	tlshd_log_syslog(LOG_INFO, "Handshake with %s (%s) was successful\n",
+			 hostname, addr);
 }
 
 /**
  * tlshd_log_failure - Emit "handshake failed" notification
  * @hostname: peer's DNS name
- * @sap: peer's IP address
- * @salen: length of IP address
+ * @addr: peer's IP address, in presentation format, or NULL
  *
  */
-void tlshd_log_failure(const char *hostname, const struct sockaddr *sap,
-		       socklen_t salen)
+void tlshd_log_failure(const char *hostname, const char *addr)
 {
-	if (salen) {
-		char buf[NI_MAXHOST];
-
-		getnameinfo(sap, salen, buf, sizeof(buf), NULL, 0, NI_NUMERICHOST);
-		syslog(LOG_ERR, "Handshake with '%s' (%s) failed\n",
-		       hostname, buf);
-	} else
-		syslog(LOG_ERR, "Handshake request failed\n");
+	if (addr)
+		tlshd_log_limited_syslog(TLSHD_LOG_FAILURE, LOG_ERR,
+					 "Handshake with '%s' (%s) failed\n",
+					 hostname, addr);
+	else
+		tlshd_log_limited_syslog(TLSHD_LOG_FAILURE, LOG_ERR,
+					 "Handshake request failed\n");
 }
 
 /**
@@ -94,7 +559,21 @@ void tlshd_log_debug(const char *fmt, ...)
 		return;
 
 	va_start(args, fmt);
-	vsyslog(LOG_DEBUG, fmt, args);
+	tlshd_log_vsyslog(LOG_DEBUG, fmt, args);
+	va_end(args);
+}
+
+/**
+ * tlshd_log_notice - Emit an informational notification
+ * @fmt - printf-style format string
+ *
+ */
+void tlshd_log_notice(const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	tlshd_log_vsyslog(LOG_INFO, fmt, args);
 	va_end(args);
 }
 
@@ -108,7 +587,7 @@ void tlshd_log_error(const char *fmt, ...)
 	va_list args;
 
 	va_start(args, fmt);
-	vsyslog(LOG_ERR, fmt, args);
+	tlshd_log_vsyslog(LOG_ERR, fmt, args);
 	va_end(args);
 }
 
@@ -119,7 +598,7 @@ void tlshd_log_error(const char *fmt, ...)
  */
 void tlshd_log_perror(const char *prefix)
 {
-	syslog(LOG_NOTICE, "%s: %s\n", prefix, strerror(errno));
+	tlshd_log_syslog(LOG_NOTICE, "%s: %s\n", prefix, strerror(errno));
 }
 
 /**
@@ -129,7 +608,7 @@ void tlshd_log_perror(const char *prefix)
  */
 void tlshd_log_gai_error(int error)
 {
-	syslog(LOG_NOTICE, "%s\n", gai_strerror(error));
+	tlshd_log_syslog(LOG_NOTICE, "%s\n", gai_strerror(error));
 }
 
 struct tlshd_cert_status_bit {
@@ -169,11 +648,29 @@ void tlshd_log_cert_verification_error(gnutls_session_t session)
 	int i;
 
 	status = gnutls_session_get_verify_cert_status(session);
+	tlshd_stats_cert_status(status);
 
 	for (i = 0; tlshd_cert_status_names[i].name; i++)
 		if (status & tlshd_cert_status_names[i].bit)
-			syslog(LOG_ERR, "Certificate %s.\n",
-			       tlshd_cert_status_names[i].name);
+			tlshd_log_limited_syslog(TLSHD_LOG_CERT, LOG_ERR,
+						 "Certificate %s.\n",
+						 tlshd_cert_status_names[i].name);
+}
+
+/**
+ * tlshd_log_cert_status_name - Describe a certificate verification failure
+ * @bit: one gnutls_certificate_status_t flag
+ *
+ * Returns NULL if @bit has no description.
+ */
+const char *tlshd_log_cert_status_name(unsigned int bit)
+{
+	int i;
+
+	for (i = 0; tlshd_cert_status_names[i].name; i++)
+		if (tlshd_cert_status_names[i].bit == bit)
+			return tlshd_cert_status_names[i].name;
+	return NULL;
 }
 
 /**
@@ -183,7 +680,9 @@ void tlshd_log_cert_verification_error(gnutls_session_t session)
  */
 void tlshd_log_gnutls_error(int error)
 {
-	syslog(LOG_NOTICE, "gnutls: %s (%d)\n", gnutls_strerror(error), error);
+	tlshd_log_limited_syslog(TLSHD_LOG_GNUTLS, LOG_NOTICE,
+				 "gnutls: %s (%d)\n",
+				 gnutls_strerror(error), error);
 }
 
 /**
@@ -194,7 +693,44 @@ void tlshd_log_gnutls_error(int error)
  */
 void tlshd_gnutls_log_func(int level, const char *msg)
 {
-	syslog(LOG_DEBUG, "gnutls(%d): %s", level, msg);
+	if (tlshd_trace_capture(level, msg))
+		return;
+	tlshd_log_syslog(LOG_DEBUG, "gnutls(%d): %s", level, msg);
+}
+
+/**
+ * tlshd_log_trace_header - Introduce a captured GnuTLS trace
+ * @fmt - printf-style format string
+ *
+ * Traces are rate limited as a whole, by their header.
+ *
+ * Return values:
+ *   %true: The header was logged; log the trace that follows it
+ *   %false: The trace is suppressed
+ */
+bool tlshd_log_trace_header(const char *fmt, ...)
+{
+	va_list args;
+	bool ret;
+
+	va_start(args, fmt);
+	ret = tlshd_log_vsyslog_class(TLSHD_LOG_TRACE, LOG_INFO, fmt, args);
+	va_end(args);
+	return ret;
+}
+
+/**
+ * tlshd_log_trace - Emit one line of a captured GnuTLS trace
+ * @fmt - printf-style format string
+ *
+ */
+void tlshd_log_trace(const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	tlshd_log_vsyslog(LOG_INFO, fmt, args);
+	va_end(args);
 }
 
 /**
@@ -206,7 +742,7 @@ void tlshd_gnutls_log_func(int level, const char *msg)
 void tlshd_gnutls_audit_func(__attribute__ ((unused)) gnutls_session_t session,
 			     const char *msg)
 {
-	syslog(LOG_INFO, "audit: %s", msg);
+	tlshd_log_syslog(LOG_INFO, "audit: %s", msg);
 }
 
 /**
@@ -217,7 +753,7 @@ void tlshd_gnutls_audit_func(__attribute__ ((unused)) gnutls_session_t session,
  */
 void tlshd_log_gerror(const char *msg, GError *error)
 {
-	syslog(LOG_ERR, "%s: %s", msg, error->message);
+	tlshd_log_syslog(LOG_ERR, "%s: %s", msg, error->message);
 }
 
 /**
@@ -228,7 +764,7 @@ void tlshd_log_gerror(const char *msg, GError *error)
  */
 void tlshd_log_nl_error(const char *msg, int err)
 {
-	syslog(LOG_ERR, "%s: %s", msg, nl_geterror(err));
+	tlshd_log_syslog(LOG_ERR, "%s: %s", msg, nl_geterror(err));
 }
 
 /**
@@ -245,7 +781,28 @@ void tlshd_log_init(const char *progname)
 		option |= LOG_PERROR;
 	openlog(progname, option, LOG_AUTH);
 
-	syslog(LOG_NOTICE, "Built from " PACKAGE_STRING " on " __DATE__ " " __TIME__);
+	tlshd_log_ring_init();
+
+	tlshd_log_syslog(LOG_NOTICE, "Built from " PACKAGE_STRING " on " __DATE__ " " __TIME__);
+}
+
+/**
+ * tlshd_log_ratelimit_init - Apply the configured failure log rate limit
+ *
+ * Called after the configuration is loaded and before any handshake
+ * children are forked.
+ */
+void tlshd_log_ratelimit_init(void)
+{
+	unsigned int rate, burst;
+
+	if (!tlshd_log_ring)
+		return;
+	if (!tlshd_config_get_log_rate_limit(&rate, &burst))
+		return;
+
+	tlshd_log_ring->interval_ns = TLSHD_LOG_NSEC_PER_SEC / rate;
+	tlshd_log_ring->tolerance_ns = tlshd_log_ring->interval_ns * (burst - 1);
 }
 
 /**
@@ -254,7 +811,7 @@ void tlshd_log_init(const char *progname)
  */
 void tlshd_log_shutdown(void)
 {
-	syslog(LOG_NOTICE, "Shutting down.");
+	tlshd_log_syslog(LOG_NOTICE, "Shutting down.");
 }
 
 /**
@@ -263,5 +820,6 @@ void tlshd_log_shutdown(void)
  */
 void tlshd_log_close(void)
 {
+	tlshd_log_ring_shutdown();
 	closelog();
 }
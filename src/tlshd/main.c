@@ -97,9 +97,28 @@ int main(int argc, char **argv)
 		tlshd_log_close();
 		return EXIT_FAILURE;
 	}
+	tlshd_log_ratelimit_init();
+
+	tlshd_stats_init();
+	tlshd_latency_init();
+	tlshd_cost_init();
+	tlshd_events_init();
+	tlshd_ktls_init();
+	tlshd_ticket_init();
+	tlshd_cache_init();
+	tlshd_rawpk_init();
+	tlshd_metrics_init();
 
 	tlshd_genl_dispatch();
 
+	tlshd_metrics_shutdown();
+	tlshd_rawpk_shutdown();
+	tlshd_cache_shutdown();
+	tlshd_ticket_shutdown();
+	tlshd_events_shutdown();
+	tlshd_cost_shutdown();
+	tlshd_latency_shutdown();
+	tlshd_stats_shutdown();
 	tlshd_config_shutdown();
 	tlshd_log_shutdown();
 	tlshd_log_close();
@@ -0,0 +1,363 @@
+/*
+ * Serve tlshd's statistics in Prometheus text format, and accept
+ * commands on the control socket.
+ *
+ * Copyright (c) 2023 Oracle and/or its affiliates.
+ *
+ * ktls-utils is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <keyutils.h>
+
+#include <gnutls/gnutls.h>
+#include <gnutls/abstract.h>
+
+#include <glib.h>
+
+#include "tlshd.h"
+
+/* How long a client has to send its request, in milliseconds */
+#define TLSHD_METRICS_REQUEST_MSEC	(200)
+
+/* How long a client has to accept the response, in seconds */
+#define TLSHD_METRICS_SEND_SECS		(2)
+
+#define TLSHD_CONTROL_REQUEST_MAX	(256)
+
+/* How long a control client has to send its whole command, in milliseconds */
+#define TLSHD_CONTROL_REQUEST_MSEC	(2000)
+
+/*
+ * The listeners are served by their own thread so that a slow client
+ * can never delay the netlink dispatcher. The thread does not log:
+ * handshake children are forked from the dispatcher while the
+ * thread runs, and must not inherit a held syslog lock.
+ */
+static int tlshd_metrics_listener = -1;
+static int tlshd_control_listener = -1;
+static int tlshd_metrics_wakeup[2] = { -1, -1 };
+static pthread_t tlshd_metrics_thread;
+static gchar *tlshd_metrics_path;
+static gchar *tlshd_control_path;
+
+static bool tlshd_metrics_send(int fd, const char *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = send(fd, buf, len, MSG_NOSIGNAL);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		buf += ret;
+		len -= ret;
+	}
+	return true;
+}
+
+/*
+ * A scraper that speaks HTTP sends a GET request, and gets an HTTP
+ * response. Anything else, including a client that sends nothing,
+ * gets the bare exposition text.
+ */
+static bool tlshd_metrics_wants_http(int fd)
+{
+	struct pollfd pfd = {
+		.fd		= fd,
+		.events		= POLLIN,
+	};
+	char request[512];
+	ssize_t len;
+
+	if (poll(&pfd, 1, TLSHD_METRICS_REQUEST_MSEC) <= 0)
+		return false;
+	len = recv(fd, request, sizeof(request), MSG_DONTWAIT);
+	return len >= 4 && !memcmp(request, "GET ", 4);
+}
+
+static void tlshd_metrics_serve(int fd)
+{
+	struct timeval timeout = {
+		.tv_sec		= TLSHD_METRICS_SEND_SECS,
+	};
+	char header[160];
+	size_t size = 0;
+	char *body = NULL;
+	bool http;
+	FILE *f;
+	int len;
+
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	http = tlshd_metrics_wants_http(fd);
+
+	f = open_memstream(&body, &size);
+	if (!f)
+		return;
+	tlshd_stats_write_metrics(f);
+	tlshd_latency_write_metrics(f);
+	tlshd_cost_write_metrics(f);
+	if (fclose(f))
+		goto out;
+
+	if (http) {
+		len = snprintf(header, sizeof(header),
+			       "HTTP/1.0 200 OK\r\n"
+			       "Content-Type: text/plain; version=0.0.4\r\n"
+			       "Content-Length: %zu\r\n\r\n", size);
+		if (!tlshd_metrics_send(fd, header, len))
+			goto out;
+	}
+	tlshd_metrics_send(fd, body, size);
+
+out:
+	free(body);
+}
+
+static int64_t tlshd_control_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * The command is the first line the client sends. The response ends
+ * with "OK" or "ERROR" on a line of its own. A client that has not
+ * sent its whole command by the deadline is dropped, so that it
+ * cannot hold up the metrics listener.
+ */
+static void tlshd_control_serve(int fd)
+{
+	struct timeval timeout = {
+		.tv_sec		= TLSHD_METRICS_SEND_SECS,
+	};
+	struct pollfd pfd = {
+		.fd		= fd,
+		.events		= POLLIN,
+	};
+	char request[TLSHD_CONTROL_REQUEST_MAX];
+	size_t size = 0, used = 0;
+	int64_t deadline, remaining;
+	char *body = NULL;
+	ssize_t len;
+	bool ok;
+	FILE *f;
+
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	deadline = tlshd_control_now_ms() + TLSHD_CONTROL_REQUEST_MSEC;
+	while (used < sizeof(request) - 1 &&
+	       !memchr(request, '\n', used)) {
+		remaining = deadline - tlshd_control_now_ms();
+		if (remaining <= 0 || poll(&pfd, 1, remaining) <= 0)
+			return;
+		len = recv(fd, request + used, sizeof(request) - 1 - used,
+			   MSG_DONTWAIT);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len <= 0)
+			break;
+		used += len;
+	}
+	request[used] = '\0';
+
+	f = open_memstream(&body, &size);
+	if (!f)
+		return;
+	ok = tlshd_control_execute(request, f);
+	fprintf(f, "%s\n", ok ? "OK" : "ERROR");
+	if (!fclose(f))
+		tlshd_metrics_send(fd, body, size);
+	free(body);
+}
+
+static void *tlshd_metrics_loop(__attribute__ ((unused)) void *arg)
+{
+	struct pollfd pfd[3] = {
+		{ .fd = tlshd_metrics_listener,	.events = POLLIN, },
+		{ .fd = tlshd_control_listener,	.events = POLLIN, },
+		{ .fd = tlshd_metrics_wakeup[0], .events = POLLIN, },
+	};
+	int fd;
+
+	while (true) {
+		/* poll(2) ignores a listener that is not configured */
+		if (poll(pfd, ARRAY_SIZE(pfd), -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (pfd[2].revents)
+			break;
+
+		if (pfd[0].revents & POLLIN) {
+			fd = accept4(tlshd_metrics_listener, NULL, NULL,
+				     SOCK_CLOEXEC);
+			if (fd >= 0) {
+				tlshd_metrics_serve(fd);
+				close(fd);
+			}
+		}
+		if (pfd[1].revents & POLLIN) {
+			fd = accept4(tlshd_control_listener, NULL, NULL,
+				     SOCK_CLOEXEC);
+			if (fd >= 0) {
+				tlshd_control_serve(fd);
+				close(fd);
+			}
+		}
+	}
+	return NULL;
+}
+
+/*
+ * On success, returns a listening socket bound to @pathname.
+ * Otherwise -1 is returned.
+ */
+static int tlshd_metrics_listen(const gchar *pathname)
+{
+	struct sockaddr_un addr = {
+		.sun_family	= AF_UNIX,
+	};
+	mode_t umask_saved;
+	int fd, ret;
+
+	if (strlen(pathname) >= sizeof(addr.sun_path)) {
+		tlshd_log_error("Socket pathname %s is too long", pathname);
+		return -1;
+	}
+	strcpy(addr.sun_path, pathname);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if (fd < 0) {
+		tlshd_log_perror("socket");
+		return -1;
+	}
+	unlink(pathname);
+
+	/* The socket must never be reachable by other users, even briefly */
+	umask_saved = umask(S_IRWXG | S_IRWXO | S_IXUSR);
+	ret = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+	umask(umask_saved);
+	if (ret < 0) {
+		tlshd_log_perror("bind");
+		goto out_close;
+	}
+	if (listen(fd, 8) < 0) {
+		tlshd_log_perror("listen");
+		goto out_unlink;
+	}
+	return fd;
+
+out_unlink:
+	unlink(pathname);
+out_close:
+	close(fd);
+	return -1;
+}
+
+static void tlshd_metrics_close(int *fd, gchar **pathname)
+{
+	if (*fd >= 0) {
+		close(*fd);
+		unlink(*pathname);
+		*fd = -1;
+	}
+	g_free(*pathname);
+	*pathname = NULL;
+}
+
+/**
+ * tlshd_metrics_init - Start serving metrics and control, if configured
+ *
+ */
+void tlshd_metrics_init(void)
+{
+	int ret;
+
+	tlshd_metrics_path = tlshd_config_get_metrics_socket();
+	if (tlshd_metrics_path)
+		tlshd_metrics_listener = tlshd_metrics_listen(tlshd_metrics_path);
+	tlshd_control_path = tlshd_config_get_control_socket();
+	if (tlshd_control_path)
+		tlshd_control_listener = tlshd_metrics_listen(tlshd_control_path);
+	if (tlshd_metrics_listener < 0 && tlshd_control_listener < 0)
+		goto out_close;
+
+	if (pipe2(tlshd_metrics_wakeup, O_CLOEXEC) < 0) {
+		tlshd_log_perror("pipe2");
+		goto out_close;
+	}
+
+	ret = pthread_create(&tlshd_metrics_thread, NULL, tlshd_metrics_loop,
+			     NULL);
+	if (ret) {
+		errno = ret;
+		tlshd_log_perror("pthread_create");
+		goto out_pipe;
+	}
+	if (tlshd_metrics_listener >= 0)
+		tlshd_log_debug("Serving metrics on %s", tlshd_metrics_path);
+	if (tlshd_control_listener >= 0)
+		tlshd_log_debug("Accepting control commands on %s",
+				tlshd_control_path);
+	return;
+
+out_pipe:
+	close(tlshd_metrics_wakeup[0]);
+	close(tlshd_metrics_wakeup[1]);
+	tlshd_metrics_wakeup[0] = tlshd_metrics_wakeup[1] = -1;
+out_close:
+	tlshd_metrics_close(&tlshd_metrics_listener, &tlshd_metrics_path);
+	tlshd_metrics_close(&tlshd_control_listener, &tlshd_control_path);
+}
+
+/**
+ * tlshd_metrics_shutdown - Stop serving metrics and control
+ *
+ */
+void tlshd_metrics_shutdown(void)
+{
+	if (tlshd_metrics_wakeup[1] < 0)
+		return;
+
+	if (write(tlshd_metrics_wakeup[1], "", 1) == 1)
+		pthread_join(tlshd_metrics_thread, NULL);
+	close(tlshd_metrics_wakeup[0]);
+	close(tlshd_metrics_wakeup[1]);
+	tlshd_metrics_wakeup[0] = tlshd_metrics_wakeup[1] = -1;
+	tlshd_metrics_close(&tlshd_metrics_listener, &tlshd_metrics_path);
+	tlshd_metrics_close(&tlshd_control_listener, &tlshd_control_path);
+}
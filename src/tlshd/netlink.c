@@ -48,6 +48,7 @@
 
 #include "tlshd.h"
 #include "netlink.h"
+#include "probes.h"
 
 static int tlshd_genl_sock_open(struct nl_sock **sock)
 {
@@ -114,10 +115,19 @@ static int tlshd_genl_event_handler(struct nl_msg *msg,
 	    HANDSHAKE_HANDLER_CLASS_TLSHD)
 		return NL_SKIP;
 
-	if (!fork()) {
-		/* child */
+	TLSHD_PROBE(upcall);
+	tlshd_ktls_refresh();
+
+	/* The child drops this count once it has replied to the kernel */
+	tlshd_stats_inc(TLSHD_STAT_IN_FLIGHT);
+	switch (fork()) {
+	case 0:
+		tlshd_stats_worker();
 		tlshd_service_socket();
 		exit(EXIT_SUCCESS);
+	case -1:
+		tlshd_log_perror("fork");
+		tlshd_stats_add(TLSHD_STAT_IN_FLIGHT, -1);
 	}
 
 	return NL_SKIP;
@@ -254,6 +264,7 @@ static const struct tlshd_handshake_parms tlshd_default_handshake_parms = {
 	.num_peerids		= 0,
 	.msg_status		= 0,
 	.session_status		= EIO,
+	.failed_phase		= TLSHD_PHASE_PEERNAME,
 
 	.num_remote_peerids	= 0,
 };
@@ -277,6 +288,7 @@ int tlshd_genl_get_handshake_parms(struct tlshd_handshake_parms *parms)
 	tlshd_log_debug("Querying the handshake service\n");
 
 	*parms = tlshd_default_handshake_parms;
+	tlshd_latency_start(parms);
 
 	ret = tlshd_genl_sock_open(&nls);
 	if (ret)
@@ -328,6 +340,10 @@ int tlshd_genl_get_handshake_parms(struct tlshd_handshake_parms *parms)
 	}
 
 	ret = parms->msg_status;
+	if (!ret) {
+		tlshd_latency_mark(parms, TLSHD_PHASE_ACCEPT);
+		TLSHD_PROBE_PARMS(accept, parms, parms->handshake_type);
+	}
 
 out_msgfree:
 	nlmsg_free(msg);
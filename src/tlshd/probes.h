@@ -0,0 +1,54 @@
+/*
+ * USDT static probes for tracing handshake requests.
+ *
+ * Copyright (c) 2023 Oracle and/or its affiliates.
+ *
+ * ktls-utils is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#ifndef _TLSHD_PROBES_H
+#define _TLSHD_PROBES_H
+
+/*
+ * Probes are in the "tlshd" provider. Except for "upcall", each
+ * probe's first three arguments are the socket descriptor, the
+ * authentication mode, and the nanoseconds elapsed since tlshd began
+ * servicing the request:
+ *
+ *   upcall()
+ *   accept(sockfd, auth_mode, elapsed_ns, handshake_type)
+ *   resolved(sockfd, auth_mode, elapsed_ns, peername)
+ *   handshake_start(sockfd, auth_mode, elapsed_ns)
+ *   handshake_end(sockfd, auth_mode, elapsed_ns, gnutls_ret)
+ *   ktls(sockfd, auth_mode, elapsed_ns, gnutls_cipher, status)
+ *   done(sockfd, auth_mode, elapsed_ns, status)
+ *
+ * The elapsed time is taken from the timestamps that are already
+ * recorded for the latency histograms, so a probe site costs a
+ * single no-op instruction when no tracer is attached.
+ */
+#ifdef ENABLE_USDT
+#include <sys/sdt.h>
+
+#define TLSHD_PROBE(name, ...)		STAP_PROBEV(tlshd, name, ##__VA_ARGS__)
+#else
+#define TLSHD_PROBE(name, ...)		do { } while (0)
+#endif
+
+#define TLSHD_PROBE_PARMS(name, parms, ...)				\
+	TLSHD_PROBE(name, (parms)->sockfd, (parms)->auth_mode,		\
+		    (parms)->phase_ns - (parms)->started_ns, ##__VA_ARGS__)
+
+#endif /* _TLSHD_PROBES_H */
@@ -0,0 +1,284 @@
+/*
+ * Authenticate peers by raw public key (RFC 7250).
+ *
+ * Copyright (c) 2023 Oracle and/or its affiliates.
+ *
+ * ktls-utils is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <keyutils.h>
+
+#include <gnutls/gnutls.h>
+#include <gnutls/abstract.h>
+#include <gnutls/crypto.h>
+
+#include <glib.h>
+
+#include "tlshd.h"
+#include "netlink.h"
+
+/*
+ * SHA-256 digests of the DER-encoded SubjectPublicKeyInfo of each
+ * peer this host is willing to talk to. The sets are loaded once,
+ * in the parent process, and inherited by each handshake child.
+ */
+static GHashTable *tlshd_rawpk_client_pins;
+static GHashTable *tlshd_rawpk_server_pins;
+
+static GHashTable **tlshd_rawpk_pins(int handshake_type)
+{
+	if (handshake_type == HANDSHAKE_MSG_TYPE_SERVERHELLO)
+		return &tlshd_rawpk_server_pins;
+	return &tlshd_rawpk_client_pins;
+}
+
+/*
+ * Each line holds one hex-encoded digest. Colons between bytes,
+ * blank lines, and lines starting with '#' are ignored.
+ */
+static bool tlshd_rawpk_parse_pin(const gchar *line, GHashTable *pins)
+{
+	unsigned char digest[TLSHD_RAWPK_PIN_SIZE];
+	unsigned int n = 0;
+	gint hi, lo;
+
+	while (*line) {
+		if (*line == ':') {
+			line++;
+			continue;
+		}
+		hi = g_ascii_xdigit_value(line[0]);
+		lo = hi < 0 ? -1 : g_ascii_xdigit_value(line[1]);
+		if (lo < 0 || n == sizeof(digest))
+			return false;
+		digest[n++] = (hi << 4) | lo;
+		line += 2;
+	}
+	if (n != sizeof(digest))
+		return false;
+
+	g_hash_table_add(pins, g_bytes_new(digest, sizeof(digest)));
+	return true;
+}
+
+static void tlshd_rawpk_load_pins(int handshake_type)
+{
+	GHashTable **pins = tlshd_rawpk_pins(handshake_type);
+	gnutls_datum_t data;
+	gchar **lines, *text;
+	guint i;
+
+	if (!tlshd_config_get_rawpk_pins(handshake_type, &data))
+		return;
+
+	text = g_strndup((const gchar *)data.data, data.size);
+	free(data.data);
+	lines = g_strsplit(text, "\n", -1);
+	g_free(text);
+
+	*pins = g_hash_table_new_full(g_bytes_hash, g_bytes_equal,
+				      (GDestroyNotify)g_bytes_unref, NULL);
+	for (i = 0; lines[i]; i++) {
+		gchar *line = g_strstrip(lines[i]);
+
+		if (*line == '\0' || *line == '#')
+			continue;
+		if (!tlshd_rawpk_parse_pin(line, *pins))
+			tlshd_log_error("Ignoring malformed pinned key on line %u",
+					i + 1);
+	}
+	g_strfreev(lines);
+
+	tlshd_log_debug("Loaded %u pinned %s public key(s)",
+			g_hash_table_size(*pins),
+			handshake_type == HANDSHAKE_MSG_TYPE_SERVERHELLO ?
+				"client" : "server");
+}
+
+/**
+ * tlshd_rawpk_init - Load pinned raw public keys
+ *
+ */
+void tlshd_rawpk_init(void)
+{
+	tlshd_rawpk_load_pins(HANDSHAKE_MSG_TYPE_CLIENTHELLO);
+	tlshd_rawpk_load_pins(HANDSHAKE_MSG_TYPE_SERVERHELLO);
+}
+
+/**
+ * tlshd_rawpk_shutdown - Release pinned raw public keys
+ *
+ */
+void tlshd_rawpk_shutdown(void)
+{
+	if (tlshd_rawpk_client_pins)
+		g_hash_table_destroy(tlshd_rawpk_client_pins);
+	if (tlshd_rawpk_server_pins)
+		g_hash_table_destroy(tlshd_rawpk_server_pins);
+	tlshd_rawpk_client_pins = NULL;
+	tlshd_rawpk_server_pins = NULL;
+}
+
+/**
+ * tlshd_rawpk_enabled - Decide whether to use raw public keys
+ * @parms: handshake parameters
+ *
+ * Return values:
+ *   %true: Authenticate this x.509 handshake with raw public keys
+ *   %false: Authenticate this handshake as requested
+ */
+bool tlshd_rawpk_enabled(struct tlshd_handshake_parms *parms)
+{
+	if (parms->auth_mode != HANDSHAKE_AUTH_X509)
+		return false;
+	return *tlshd_rawpk_pins(parms->handshake_type) != NULL;
+}
+
+/**
+ * tlshd_rawpk_verify_function - Check remote's raw public key
+ * @session: session in the midst of a handshake
+ *
+ * Return values:
+ *   %GNUTLS_E_SUCCESS: The peer's public key is pinned
+ *   %GNUTLS_E_CERTIFICATE_ERROR: The peer's public key is not pinned
+ */
+static int tlshd_rawpk_verify_function(gnutls_session_t session)
+{
+	struct tlshd_handshake_parms *parms = gnutls_session_get_ptr(session);
+	unsigned char digest[TLSHD_RAWPK_PIN_SIZE];
+	const gnutls_datum_t *spki;
+	unsigned int count;
+	GBytes *key;
+	bool found;
+
+	if (gnutls_certificate_type_get2(session, GNUTLS_CTYPE_PEERS) !=
+	    GNUTLS_CRT_RAWPK)
+		return GNUTLS_E_CERTIFICATE_ERROR;
+	spki = gnutls_certificate_get_peers(session, &count);
+	if (!spki || count != 1) {
+		tlshd_log_debug("The peer offered no public key.");
+		return GNUTLS_E_CERTIFICATE_ERROR;
+	}
+
+	if (gnutls_hash_fast(GNUTLS_DIG_SHA256, spki->data, spki->size,
+			     digest) < 0)
+		return GNUTLS_E_CERTIFICATE_ERROR;
+	key = g_bytes_new(digest, sizeof(digest));
+	found = g_hash_table_contains(*tlshd_rawpk_pins(parms->handshake_type),
+				      key);
+	g_bytes_unref(key);
+
+	if (!found) {
+		tlshd_log_error("The peer's public key is not pinned.");
+		return GNUTLS_E_CERTIFICATE_ERROR;
+	}
+	tlshd_log_debug("The peer's public key is pinned.");
+	return GNUTLS_E_SUCCESS;
+}
+
+/*
+ * The local public key is derived from the configured private key.
+ * On success, @cred owns the key pair.
+ */
+static bool tlshd_rawpk_set_key(gnutls_certificate_credentials_t cred,
+				int handshake_type)
+{
+	gnutls_privkey_t privkey;
+	gnutls_pubkey_t pubkey;
+	gnutls_pcert_st pcert;
+	int ret;
+
+	if (!tlshd_config_get_rawpk_privkey(handshake_type, &privkey))
+		return false;
+
+	ret = gnutls_pubkey_init(&pubkey);
+	if (ret != GNUTLS_E_SUCCESS)
+		goto out_privkey;
+	ret = gnutls_pubkey_import_privkey(pubkey, privkey, 0, 0);
+	if (ret != GNUTLS_E_SUCCESS)
+		goto out_pubkey;
+	ret = gnutls_pcert_import_rawpk(&pcert, pubkey, 0);
+	if (ret != GNUTLS_E_SUCCESS)
+		goto out_pubkey;
+
+	ret = gnutls_certificate_set_key(cred, NULL, 0, &pcert, 1, privkey);
+	if (ret != GNUTLS_E_SUCCESS) {
+		gnutls_pcert_deinit(&pcert);
+		goto out_privkey;
+	}
+	return true;
+
+out_pubkey:
+	gnutls_pubkey_deinit(pubkey);
+out_privkey:
+	tlshd_log_gnutls_error(ret);
+	gnutls_privkey_deinit(privkey);
+	return false;
+}
+
+/**
+ * tlshd_rawpk_handshake - Perform a handshake using raw public keys
+ * @parms: handshake parameters
+ * @flags: gnutls_init(3) flags for this side of the handshake
+ *
+ * Both sides present a bare SubjectPublicKeyInfo, which is checked
+ * against the pinned key set. No certificate chains are exchanged
+ * or validated, and no peer identity is returned to the kernel.
+ */
+void tlshd_rawpk_handshake(struct tlshd_handshake_parms *parms,
+			   unsigned int flags)
+{
+	gnutls_certificate_credentials_t cred;
+	gnutls_session_t session;
+	int ret;
+
+	ret = gnutls_certificate_allocate_credentials(&cred);
+	if (ret != GNUTLS_E_SUCCESS) {
+		tlshd_log_gnutls_error(ret);
+		return;
+	}
+	if (!tlshd_rawpk_set_key(cred, parms->handshake_type))
+		goto out_free_creds;
+	gnutls_certificate_set_verify_function(cred,
+					       tlshd_rawpk_verify_function);
+
+	ret = gnutls_init(&session, flags | GNUTLS_ENABLE_RAWPK);
+	if (ret != GNUTLS_E_SUCCESS) {
+		tlshd_log_gnutls_error(ret);
+		goto out_free_creds;
+	}
+	gnutls_transport_set_int(session, parms->sockfd);
+	gnutls_session_set_ptr(session, parms);
+	gnutls_credentials_set(session, GNUTLS_CRD_CERTIFICATE, cred);
+	if (parms->handshake_type == HANDSHAKE_MSG_TYPE_SERVERHELLO)
+		gnutls_certificate_server_set_request(session,
+						      GNUTLS_CERT_REQUIRE);
+
+	parms->rawpk = true;
+	tlshd_start_tls_handshake(session, parms);
+
+	gnutls_deinit(session);
+
+out_free_creds:
+	gnutls_certificate_free_credentials(cred);
+}
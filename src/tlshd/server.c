@@ -41,30 +41,44 @@
 #include "tlshd.h"
 #include "netlink.h"
 
-static gnutls_privkey_t tlshd_server_privkey;
-static gnutls_pcert_st tlshd_server_cert;
+static gnutls_privkey_t tlshd_server_privkeys[TLSHD_MAX_IDENTITIES];
+static gnutls_pcert_st tlshd_server_certs[TLSHD_MAX_IDENTITIES];
+static unsigned int tlshd_server_identities;
 static unsigned int tlshd_num_remote_peerids;
 static key_serial_t tlshd_remote_peerid[10];
 
 /*
- * XXX: After this point, tlshd_server_cert should be deinited on error.
+ * XXX: After this point, tlshd_server_certs should be deinited on error.
  */
 static bool tlshd_x509_server_get_cert(struct tlshd_handshake_parms *parms)
 {
-	if (parms->x509_cert != TLS_NO_CERT)
-		return tlshd_keyring_get_cert(parms->x509_cert, &tlshd_server_cert);
-	return tlshd_config_get_server_cert(&tlshd_server_cert);
+	if (parms->x509_cert != TLS_NO_CERT) {
+		tlshd_server_identities = 1;
+		return tlshd_keyring_get_cert(parms->x509_cert, &tlshd_server_certs[0]);
+	}
+	tlshd_server_identities = TLSHD_MAX_IDENTITIES;
+	return tlshd_config_get_server_certs(tlshd_server_certs,
+					     &tlshd_server_identities);
 }
 
 /*
- * XXX: After this point, tlshd_server_privkey should be deinited on error.
+ * XXX: After this point, tlshd_server_privkeys should be deinited on error.
  */
 static bool tlshd_x509_server_get_privkey(struct tlshd_handshake_parms *parms)
 {
+	unsigned int count = TLSHD_MAX_IDENTITIES;
+
 	if (parms->x509_privkey != TLS_NO_PRIVKEY)
 		return tlshd_keyring_get_privkey(parms->x509_privkey,
-						 tlshd_server_privkey);
-	return tlshd_config_get_server_privkey(&tlshd_server_privkey);
+						 tlshd_server_privkeys[0]);
+	if (!tlshd_config_get_server_privkeys(tlshd_server_privkeys, &count))
+		return false;
+	if (count != tlshd_server_identities) {
+		tlshd_log_error("Found %u certificates but %u private keys",
+				tlshd_server_identities, count);
+		return false;
+	}
+	return true;
 }
 
 static void tlshd_x509_log_issuers(const gnutls_datum_t *req_ca_rdn, int nreqs)
@@ -103,13 +117,14 @@ static void tlshd_x509_log_issuers(const gnutls_datum_t *req_ca_rdn, int nreqs)
 static int
 tlshd_x509_retrieve_key_cb(gnutls_session_t session,
 			   const gnutls_datum_t *req_ca_rdn, int nreqs,
-			   __attribute__ ((unused)) const gnutls_pk_algorithm_t *pk_algos,
-			   __attribute__ ((unused)) int pk_algos_length,
+			   const gnutls_pk_algorithm_t *pk_algos,
+			   int pk_algos_length,
 			   gnutls_pcert_st **pcert,
 			   unsigned int *pcert_length,
 			   gnutls_privkey_t *privkey)
 {
 	gnutls_certificate_type_t type;
+	unsigned int i;
 
 	tlshd_x509_log_issuers(req_ca_rdn, nreqs);
 
@@ -117,9 +132,11 @@ tlshd_x509_retrieve_key_cb(gnutls_session_t session,
 	if (type != GNUTLS_CRT_X509)
 		return -1;
 
+	i = tlshd_x509_select_identity(tlshd_server_certs, tlshd_server_identities,
+				       pk_algos, pk_algos_length);
 	*pcert_length = 1;
-	*pcert = &tlshd_server_cert;
-	*privkey = tlshd_server_privkey;
+	*pcert = &tlshd_server_certs[i];
+	*privkey = tlshd_server_privkeys[i];
 	return 0;
 }
 
@@ -133,8 +150,7 @@ tlshd_x509_retrieve_key_cb(gnutls_session_t session,
  */
 static int tlshd_server_x509_verify_function(gnutls_session_t session)
 {
-	const gnutls_datum_t *peercerts;
-	unsigned int i, status;
+	unsigned int status;
 	const char *hostname;
 	gnutls_datum_t out;
 	int type, ret;
@@ -165,26 +181,11 @@ static int tlshd_server_x509_verify_function(gnutls_session_t session)
 	 * to get picky. Kernel would have to tell us what to look for
 	 * via a netlink attribute. */
 
-	peercerts = gnutls_certificate_get_peers(session,
-						 &tlshd_num_remote_peerids);
-	if (!peercerts || tlshd_num_remote_peerids == 0) {
-		tlshd_log_debug("The peer cert list is empty.\n");
+	if (!tlshd_x509_save_peers(session, hostname,
+				   tlshd_remote_peerid,
+				   ARRAY_SIZE(tlshd_remote_peerid),
+				   &tlshd_num_remote_peerids))
                 return GNUTLS_E_CERTIFICATE_ERROR;
-	}
-
-	tlshd_log_debug("The peer offered %d certificate(s).\n",
-			tlshd_num_remote_peerids);
-
-	if (tlshd_num_remote_peerids > ARRAY_SIZE(tlshd_remote_peerid))
-		tlshd_num_remote_peerids= ARRAY_SIZE(tlshd_remote_peerid);
-	for (i = 0; i < tlshd_num_remote_peerids; i++) {
-		gnutls_x509_crt_t cert;
-
-		gnutls_x509_crt_init(&cert);
-		gnutls_x509_crt_import(cert, &peercerts[i], GNUTLS_X509_FMT_DER);
-		tlshd_remote_peerid[i] = tlshd_keyring_create_cert(cert, hostname);
-		gnutls_x509_crt_deinit(cert);
-	}
 
 	return GNUTLS_E_SUCCESS;
 }
@@ -230,9 +231,25 @@ static void tlshd_server_x509_handshake(struct tlshd_handshake_parms *parms)
 	gnutls_certificate_set_verify_function(xcred,
 					       tlshd_server_x509_verify_function);
 	gnutls_certificate_server_set_request(session, GNUTLS_CERT_REQUEST);
+	tlshd_set_cert_compression(session, parms);
+	if (tlshd_ticket_enable_server(session))
+		tlshd_log_debug("Session tickets enabled");
 
 	tlshd_start_tls_handshake(session, parms);
 
+	/*
+	 * The verify function is not invoked when a client resumes
+	 * a session, but the client's certificate is carried in the
+	 * ticket.
+	 */
+	if (!parms->session_status && gnutls_session_is_resumed(session)) {
+		tlshd_log_debug("Session was resumed");
+		tlshd_x509_save_peers(session, parms->peername,
+				      tlshd_remote_peerid,
+				      ARRAY_SIZE(tlshd_remote_peerid),
+				      &tlshd_num_remote_peerids);
+	}
+
 	gnutls_deinit(session);
 
 out_free_creds:
@@ -323,12 +340,16 @@ void tlshd_serverhello_handshake(struct tlshd_handshake_parms *parms)
 		gnutls_global_set_log_level(tlshd_tls_debug);
 	gnutls_global_set_log_function(tlshd_gnutls_log_func);
 	gnutls_global_set_audit_log_function(tlshd_gnutls_audit_func);
+	tlshd_trace_begin();
 
 	tlshd_log_debug("System config file: %s", gnutls_get_system_config_file());
 
 	switch (parms->auth_mode) {
 	case HANDSHAKE_AUTH_X509:
-		tlshd_server_x509_handshake(parms);
+		if (tlshd_rawpk_enabled(parms))
+			tlshd_rawpk_handshake(parms, GNUTLS_SERVER);
+		else
+			tlshd_server_x509_handshake(parms);
 		break;
 	case HANDSHAKE_AUTH_PSK:
 		tlshd_server_psk_handshake(parms);
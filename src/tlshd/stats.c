@@ -0,0 +1,390 @@
+/*
+ * Count events across all handshake children.
+ *
+ * Copyright (c) 2023 Oracle and/or its affiliates.
+ *
+ * ktls-utils is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <keyutils.h>
+
+#include <gnutls/gnutls.h>
+#include <gnutls/abstract.h>
+
+#include <glib.h>
+
+#include "tlshd.h"
+
+/*
+ * Each handshake runs in a short-lived child process, so counters
+ * are kept in an anonymous shared mapping that the parent creates
+ * before any children are forked.
+ *
+ * Concurrent children would contend for the same cache lines if
+ * they all updated one set of counters. Instead each child claims
+ * one of several cache-aligned slots when it starts, and readers
+ * add the slots together. Recording an event is a single relaxed
+ * atomic add, with no locks and no system calls.
+ */
+#define TLSHD_STATS_CACHELINE	(64)
+#define TLSHD_STATS_SLOTS	(32)
+
+/* GnuTLS error codes are small negative numbers */
+#define TLSHD_STATS_GNUTLS_ERRORS	(512)
+
+/* One per bit of gnutls_certificate_status_t */
+#define TLSHD_STATS_CERT_ERRORS		(32)
+
+struct tlshd_stats_slot {
+	uint64_t		counters[TLSHD_STAT_MAX];
+	uint64_t		gnutls_errors[TLSHD_STATS_GNUTLS_ERRORS];
+	uint64_t		cert_errors[TLSHD_STATS_CERT_ERRORS];
+} __attribute__ ((aligned(TLSHD_STATS_CACHELINE)));
+
+struct tlshd_stats {
+	struct tlshd_stats_slot	slots[TLSHD_STATS_SLOTS];
+	unsigned int		next_slot;
+};
+
+static struct tlshd_stats *tlshd_stats;
+
+/* The parent records into slot zero */
+static struct tlshd_stats_slot *tlshd_stats_slot;
+
+/*
+ * Each counter has a description for the debug log, and a metric
+ * name and optional labels for the metrics endpoint. Counters that
+ * share a metric name form a single Prometheus family.
+ */
+struct tlshd_stat_desc {
+	const char		*name;
+	const char		*metric;
+	const char		*labels;
+};
+
+#define TLSHD_STAT(_stat, _name, _metric, _labels)			\
+	[TLSHD_STAT_##_stat] = {					\
+		.name		= _name,				\
+		.metric		= _metric,				\
+		.labels		= _labels,				\
+	}
+
+static const struct tlshd_stat_desc tlshd_stat_descs[TLSHD_STAT_MAX] = {
+	TLSHD_STAT(KEYSHARE_PREDICTED, "key shares predicted",
+		   "key_shares_predicted_total", NULL),
+	TLSHD_STAT(HRR, "HelloRetryRequests received",
+		   "hello_retry_requests_total", NULL),
+	TLSHD_STAT(HRR_PREDICTED, "HelloRetryRequests after prediction",
+		   "hello_retry_requests_predicted_total", NULL),
+	TLSHD_STAT(TX_ZEROCOPY, "kTLS TX zerocopy enabled",
+		   "ktls_tx_zerocopy_total", "result=\"enabled\""),
+	TLSHD_STAT(TX_ZEROCOPY_FAILED, "kTLS TX zerocopy not available",
+		   "ktls_tx_zerocopy_total", "result=\"unavailable\""),
+	TLSHD_STAT(RX_NO_PAD, "kTLS RX no-pad enabled",
+		   "ktls_rx_no_pad_total", NULL),
+	TLSHD_STAT(HANDSHAKES_TUNED, "handshakes with TCP tuning",
+		   "tcp_tuning_handshakes_total", "tuning=\"on\""),
+	TLSHD_STAT(HANDSHAKES_UNTUNED, "handshakes without TCP tuning",
+		   "tcp_tuning_handshakes_total", "tuning=\"off\""),
+	TLSHD_STAT(HANDSHAKE_USEC_TUNED, "usec in handshakes with TCP tuning",
+		   "tcp_tuning_handshake_usec_total", "tuning=\"on\""),
+	TLSHD_STAT(HANDSHAKE_USEC_UNTUNED, "usec in handshakes without TCP tuning",
+		   "tcp_tuning_handshake_usec_total", "tuning=\"off\""),
+	TLSHD_STAT(CERT_COMPRESSED_SENT, "compressed certificates sent",
+		   "compressed_certificates_total", "direction=\"sent\""),
+	TLSHD_STAT(CERT_COMPRESSED_RECEIVED, "compressed certificates received",
+		   "compressed_certificates_total", "direction=\"received\""),
+	TLSHD_STAT(CERT_COMPRESSION_SAVED, "bytes saved by certificate compression",
+		   "certificate_compression_saved_bytes_total", NULL),
+	TLSHD_STAT(ABANDONED_LOOKUP, "requests abandoned before peer name lookup",
+		   "requests_abandoned_total", "phase=\"lookup\""),
+	TLSHD_STAT(ABANDONED_CREDENTIALS, "requests abandoned before loading credentials",
+		   "requests_abandoned_total", "phase=\"credentials\""),
+	TLSHD_STAT(ABANDONED_HANDSHAKE, "requests abandoned before the handshake",
+		   "requests_abandoned_total", "phase=\"handshake\""),
+	TLSHD_STAT(HANDSHAKES_STARTED, "handshake requests accepted",
+		   "requests_total", NULL),
+	TLSHD_STAT(HANDSHAKES_SUCCEEDED, "handshakes succeeded",
+		   "handshakes_succeeded_total", NULL),
+	TLSHD_STAT(FAILED_LOOKUP, "handshakes failed during peer name lookup",
+		   "handshakes_failed_total", "phase=\"lookup\""),
+	TLSHD_STAT(FAILED_SETUP, "handshakes failed during session setup",
+		   "handshakes_failed_total", "phase=\"setup\""),
+	TLSHD_STAT(FAILED_HANDSHAKE, "handshakes failed during TLS negotiation",
+		   "handshakes_failed_total", "phase=\"handshake\""),
+	TLSHD_STAT(FAILED_KTLS, "handshakes failed during kTLS setup",
+		   "handshakes_failed_total", "phase=\"ktls\""),
+	TLSHD_STAT(CIPHER_CHACHA20_POLY1305, "sessions using CHACHA20-POLY1305",
+		   "sessions_total", "cipher=\"CHACHA20-POLY1305\""),
+	TLSHD_STAT(CIPHER_AES_GCM_256, "sessions using AES-256-GCM",
+		   "sessions_total", "cipher=\"AES-256-GCM\""),
+	TLSHD_STAT(CIPHER_AES_GCM_128, "sessions using AES-128-GCM",
+		   "sessions_total", "cipher=\"AES-128-GCM\""),
+	TLSHD_STAT(CIPHER_AES_CCM_128, "sessions using AES-128-CCM",
+		   "sessions_total", "cipher=\"AES-128-CCM\""),
+	TLSHD_STAT(CIPHER_SM4_GCM, "sessions using SM4-GCM",
+		   "sessions_total", "cipher=\"SM4-GCM\""),
+	TLSHD_STAT(CIPHER_SM4_CCM, "sessions using SM4-CCM",
+		   "sessions_total", "cipher=\"SM4-CCM\""),
+	TLSHD_STAT(BYTES_SENT, "handshake bytes sent",
+		   "handshake_bytes_total", "direction=\"sent\""),
+	TLSHD_STAT(BYTES_RECEIVED, "handshake bytes received",
+		   "handshake_bytes_total", "direction=\"received\""),
+	TLSHD_STAT(IN_FLIGHT, "handshake requests in flight",
+		   "requests_in_flight", NULL),
+	TLSHD_STAT(SESSIONS_RESUMED, "sessions resumed",
+		   "sessions_resumed_total", NULL),
+	TLSHD_STAT(LOG_DROPPED, "log messages dropped",
+		   "log_messages_dropped_total", NULL),
+	TLSHD_STAT(LOG_SUPPRESSED_FAILURE, "handshake failure messages suppressed",
+		   "log_messages_suppressed_total", "class=\"failure\""),
+	TLSHD_STAT(LOG_SUPPRESSED_CERT, "certificate messages suppressed",
+		   "log_messages_suppressed_total", "class=\"certificate\""),
+	TLSHD_STAT(LOG_SUPPRESSED_GNUTLS, "GnuTLS error messages suppressed",
+		   "log_messages_suppressed_total", "class=\"gnutls\""),
+	TLSHD_STAT(LOG_SUPPRESSED_TRACE, "GnuTLS traces suppressed",
+		   "log_messages_suppressed_total", "class=\"trace\""),
+};
+
+/**
+ * tlshd_stats_init - Create the shared statistics area
+ *
+ */
+void tlshd_stats_init(void)
+{
+	tlshd_stats = mmap(NULL, sizeof(*tlshd_stats), PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (tlshd_stats == MAP_FAILED) {
+		tlshd_log_perror("mmap");
+		tlshd_stats = NULL;
+		return;
+	}
+	tlshd_stats->next_slot = 1;
+	tlshd_stats_slot = &tlshd_stats->slots[0];
+}
+
+/**
+ * tlshd_stats_worker - Claim a counter slot for a handshake child
+ *
+ * Called once in each newly forked child.
+ */
+void tlshd_stats_worker(void)
+{
+	unsigned int slot;
+
+	if (!tlshd_stats)
+		return;
+	slot = __atomic_fetch_add(&tlshd_stats->next_slot, 1,
+				  __ATOMIC_RELAXED);
+	tlshd_stats_slot = &tlshd_stats->slots[slot % TLSHD_STATS_SLOTS];
+}
+
+/**
+ * tlshd_stats_shutdown - Report and release the statistics area
+ *
+ */
+void tlshd_stats_shutdown(void)
+{
+	unsigned int i;
+
+	if (!tlshd_stats)
+		return;
+
+	for (i = 0; i < TLSHD_STAT_MAX; i++)
+		tlshd_log_debug("%s: %llu", tlshd_stat_descs[i].name,
+				(unsigned long long)tlshd_stats_get(i));
+
+	/* Records that arrived padded despite TLS_RX_EXPECT_NO_PAD */
+	tlshd_log_debug("kTLS RX no-pad violations: %llu",
+			(unsigned long long)tlshd_ktls_kernel_stat("TlsRxNoPadViolation"));
+
+	munmap(tlshd_stats, sizeof(*tlshd_stats));
+	tlshd_stats = NULL;
+	tlshd_stats_slot = NULL;
+}
+
+/**
+ * tlshd_stats_inc - Bump a counter
+ * @stat: counter to increment
+ *
+ */
+void tlshd_stats_inc(enum tlshd_stat stat)
+{
+	if (!tlshd_stats_slot)
+		return;
+	__atomic_fetch_add(&tlshd_stats_slot->counters[stat], 1,
+			   __ATOMIC_RELAXED);
+}
+
+/**
+ * tlshd_stats_add - Add to a counter
+ * @stat: counter to increase
+ * @value: amount to add
+ *
+ */
+void tlshd_stats_add(enum tlshd_stat stat, uint64_t value)
+{
+	if (!tlshd_stats_slot)
+		return;
+	__atomic_fetch_add(&tlshd_stats_slot->counters[stat], value,
+			   __ATOMIC_RELAXED);
+}
+
+/**
+ * tlshd_stats_get - Read a counter
+ * @stat: counter to read
+ *
+ * Returns the sum of @stat over every slot.
+ */
+uint64_t tlshd_stats_get(enum tlshd_stat stat)
+{
+	uint64_t sum = 0;
+	unsigned int i;
+
+	if (!tlshd_stats)
+		return 0;
+	for (i = 0; i < TLSHD_STATS_SLOTS; i++)
+		sum += __atomic_load_n(&tlshd_stats->slots[i].counters[stat],
+				       __ATOMIC_RELAXED);
+	return sum;
+}
+
+/**
+ * tlshd_stats_gnutls_error - Count a handshake that failed
+ * @error: GnuTLS error code
+ *
+ */
+void tlshd_stats_gnutls_error(int error)
+{
+	if (!tlshd_stats_slot || error >= 0 ||
+	    error <= -TLSHD_STATS_GNUTLS_ERRORS)
+		return;
+	__atomic_fetch_add(&tlshd_stats_slot->gnutls_errors[-error], 1,
+			   __ATOMIC_RELAXED);
+}
+
+static uint64_t tlshd_stats_get_gnutls_error(int index)
+{
+	uint64_t sum = 0;
+	unsigned int i;
+
+	for (i = 0; i < TLSHD_STATS_SLOTS; i++)
+		sum += __atomic_load_n(&tlshd_stats->slots[i].gnutls_errors[index],
+				       __ATOMIC_RELAXED);
+	return sum;
+}
+
+/**
+ * tlshd_stats_cert_status - Count a failed certificate verification
+ * @status: gnutls_certificate_status_t flags
+ *
+ * Each reason for the failure is counted separately.
+ */
+void tlshd_stats_cert_status(unsigned int status)
+{
+	unsigned int i;
+
+	if (!tlshd_stats_slot)
+		return;
+	for (i = 0; i < TLSHD_STATS_CERT_ERRORS; i++)
+		if (status & (1U << i))
+			__atomic_fetch_add(&tlshd_stats_slot->cert_errors[i], 1,
+					   __ATOMIC_RELAXED);
+}
+
+static uint64_t tlshd_stats_get_cert_error(unsigned int index)
+{
+	uint64_t sum = 0;
+	unsigned int i;
+
+	for (i = 0; i < TLSHD_STATS_SLOTS; i++)
+		sum += __atomic_load_n(&tlshd_stats->slots[i].cert_errors[index],
+				       __ATOMIC_RELAXED);
+	return sum;
+}
+
+/*
+ * Emit a TYPE line only for the first counter in each family. The
+ * exposition format requires all samples of a family to be adjacent,
+ * so tlshd_stat_descs keeps each family's entries together.
+ */
+static bool tlshd_stats_first_in_family(unsigned int stat)
+{
+	return stat == 0 || strcmp(tlshd_stat_descs[stat - 1].metric,
+				   tlshd_stat_descs[stat].metric);
+}
+
+/**
+ * tlshd_stats_write_metrics - Emit counters in Prometheus text format
+ * @f: stream to write to
+ *
+ * Metric names that end in "_total" are counters; the others are
+ * gauges.
+ */
+void tlshd_stats_write_metrics(FILE *f)
+{
+	const struct tlshd_stat_desc *desc;
+	const char *type;
+	unsigned int i;
+	uint64_t value;
+
+	if (!tlshd_stats)
+		return;
+
+	for (i = 0; i < TLSHD_STAT_MAX; i++) {
+		desc = &tlshd_stat_descs[i];
+		if (tlshd_stats_first_in_family(i)) {
+			type = g_str_has_suffix(desc->metric, "_total") ?
+				"counter" : "gauge";
+			fprintf(f, "# TYPE tlshd_%s %s\n", desc->metric, type);
+		}
+		fprintf(f, "tlshd_%s%s%s%s %llu\n", desc->metric,
+			desc->labels ? "{" : "",
+			desc->labels ? desc->labels : "",
+			desc->labels ? "}" : "",
+			(unsigned long long)tlshd_stats_get(i));
+	}
+
+	fprintf(f, "# TYPE tlshd_handshake_errors_total counter\n");
+	for (i = 1; i < TLSHD_STATS_GNUTLS_ERRORS; i++) {
+		value = tlshd_stats_get_gnutls_error(i);
+		if (!value)
+			continue;
+		fprintf(f, "tlshd_handshake_errors_total{error=\"%s\"} %llu\n",
+			gnutls_strerror_name(-(int)i),
+			(unsigned long long)value);
+	}
+
+	fprintf(f, "# TYPE tlshd_certificate_errors_total counter\n");
+	for (i = 0; i < TLSHD_STATS_CERT_ERRORS; i++) {
+		const char *reason = tlshd_log_cert_status_name(1U << i);
+
+		value = tlshd_stats_get_cert_error(i);
+		if (!value || !reason)
+			continue;
+		fprintf(f, "tlshd_certificate_errors_total{reason=\"%s\"} %llu\n",
+			reason, (unsigned long long)value);
+	}
+}
@@ -0,0 +1,166 @@
+/*
+ * Manage the key used to protect server-side session tickets.
+ *
+ * Copyright (c) 2023 Oracle and/or its affiliates.
+ *
+ * ktls-utils is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <keyutils.h>
+
+#include <gnutls/gnutls.h>
+#include <gnutls/abstract.h>
+
+#include <glib.h>
+
+#include "tlshd.h"
+#include "netlink.h"
+
+/*
+ * The ticket master key is created (or read) once, in the parent
+ * process, before any handshake requests are serviced. Each
+ * handshake child inherits a copy when it is forked.
+ *
+ * GnuTLS never uses the master key directly. It derives the actual
+ * ticket encryption key from the master key and the current time,
+ * rotating it every ticket lifetime, and continues to accept tickets
+ * protected by the previous key. Instances that share the same master
+ * key (via a key file) therefore rotate in lock-step and can decrypt
+ * each other's tickets.
+ */
+static gnutls_datum_t tlshd_ticket_key;
+static unsigned int tlshd_ticket_lifetime;
+
+/**
+ * tlshd_ticket_init - Prepare the session ticket master key
+ *
+ */
+void tlshd_ticket_init(void)
+{
+	int ret;
+
+	if (!tlshd_config_get_session_tickets(&tlshd_ticket_lifetime))
+		return;
+
+	if (!tlshd_config_get_ticket_key(&tlshd_ticket_key)) {
+		tlshd_log_error("Server session tickets are disabled.");
+		return;
+	}
+	if (tlshd_ticket_key.data) {
+		tlshd_log_debug("Using shared session ticket key");
+		return;
+	}
+
+	ret = gnutls_session_ticket_key_generate(&tlshd_ticket_key);
+	if (ret != GNUTLS_E_SUCCESS) {
+		tlshd_log_gnutls_error(ret);
+		tlshd_log_error("Server session tickets are disabled.");
+		tlshd_ticket_key.data = NULL;
+		tlshd_ticket_key.size = 0;
+		return;
+	}
+	tlshd_log_debug("Generated a session ticket key");
+}
+
+/**
+ * tlshd_ticket_shutdown - Release the session ticket master key
+ *
+ */
+void tlshd_ticket_shutdown(void)
+{
+	if (!tlshd_ticket_key.data)
+		return;
+
+	gnutls_memset(tlshd_ticket_key.data, 0, tlshd_ticket_key.size);
+	gnutls_free(tlshd_ticket_key.data);
+	tlshd_ticket_key.data = NULL;
+	tlshd_ticket_key.size = 0;
+}
+
+/**
+ * tlshd_ticket_enabled - Report whether this handshake may use tickets
+ * @parms: handshake parameters
+ *
+ * Return values:
+ *   %true: The handshake will offer or accept session tickets
+ *   %false: Session tickets are disabled for this handshake
+ */
+bool tlshd_ticket_enabled(struct tlshd_handshake_parms *parms)
+{
+	switch (parms->handshake_type) {
+	case HANDSHAKE_MSG_TYPE_CLIENTHELLO:
+		/*
+		 * A TLS 1.3 server sends its tickets after the handshake,
+		 * by which time the kernel consumer owns the socket and
+		 * would receive them instead.
+		 */
+		return false;
+	case HANDSHAKE_MSG_TYPE_SERVERHELLO:
+		if (!tlshd_ticket_key.data)
+			return false;
+		return parms->auth_mode == HANDSHAKE_AUTH_X509;
+	}
+	return false;
+}
+
+/**
+ * tlshd_ticket_enable_server - Enable server-side session tickets
+ * @session: server session to configure
+ *
+ * Return values:
+ *   %true: @session will issue and accept session tickets
+ *   %false: Session tickets are not enabled for @session
+ */
+bool tlshd_ticket_enable_server(gnutls_session_t session)
+{
+	int ret;
+
+	if (!tlshd_ticket_key.data)
+		return false;
+
+	ret = gnutls_session_ticket_enable_server(session, &tlshd_ticket_key);
+	if (ret != GNUTLS_E_SUCCESS) {
+		tlshd_log_gnutls_error(ret);
+		return false;
+	}
+
+	/* Also sets the period at which the ticket encryption key rotates */
+	gnutls_db_set_cache_expiration(session, tlshd_ticket_lifetime);
+	return true;
+}
+
+/**
+ * tlshd_ticket_write_status - Describe the session ticket settings
+ * @f: stream to write to
+ *
+ */
+void tlshd_ticket_write_status(FILE *f)
+{
+	if (!tlshd_ticket_key.data) {
+		fprintf(f, "Server session tickets are disabled\n");
+		return;
+	}
+	fprintf(f, "Server session tickets are enabled, lifetime %u sec\n",
+		tlshd_ticket_lifetime);
+}
@@ -16,6 +16,8 @@
  * 02110-1301, USA.
  */
 
+#include <stdint.h>
+#include <stdio.h>
 #include <linux/netlink.h>
 
 #define ARRAY_SIZE(a)		(sizeof(a) / sizeof((a)[0]))
@@ -26,8 +28,37 @@ extern int tlshd_stderr;
 
 struct nl_sock;
 
+/* Handshake phases whose latency is recorded */
+enum tlshd_phase {
+	TLSHD_PHASE_ACCEPT,
+	TLSHD_PHASE_PEERNAME,
+	TLSHD_PHASE_LOOKUP,
+	TLSHD_PHASE_CREDENTIALS,
+	TLSHD_PHASE_HANDSHAKE,
+	TLSHD_PHASE_KTLS,
+	TLSHD_PHASE_DONE,
+	TLSHD_PHASE_TOTAL,
+
+	TLSHD_PHASE_MAX
+};
+
+/* What a successful handshake negotiated, for the event record */
+struct tlshd_session_desc {
+	const char	*version;
+	const char	*cipher;
+	const char	*group;
+	const char	*sigalg;
+	bool		resumed;
+};
+
 struct tlshd_handshake_parms {
 	char		*peername;
+	struct sockaddr	*peeraddr;
+	socklen_t	peeraddr_len;
+	const char	*peeraddr_text;
+	int		key_share_group;
+	unsigned int	ktls_flags;
+	bool		rawpk;
 	int		sockfd;
 	int		handshake_type;
 	unsigned int	timeout_ms;
@@ -42,20 +73,96 @@ struct tlshd_handshake_parms {
 
 	unsigned int	num_remote_peerids;
 	key_serial_t	*remote_peerid;
+
+	uint64_t	started_ns;
+	uint64_t	phase_ns;
+	enum tlshd_phase phase;
+	enum tlshd_phase failed_phase;
+	uint64_t	phase_durations_ns[TLSHD_PHASE_MAX];
+
+	struct tlshd_session_desc negotiated;
 };
 
+/* cache.c */
+extern void tlshd_cache_init(void);
+extern void tlshd_cache_shutdown(void);
+extern void tlshd_cache_handshake_hook(unsigned int htype,
+				       unsigned int incoming);
+extern void tlshd_cache_predict_group(struct tlshd_handshake_parms *parms);
+extern void tlshd_cache_remember_group(gnutls_session_t session,
+				       struct tlshd_handshake_parms *parms);
+extern unsigned int tlshd_cache_flush(void);
+extern void tlshd_cache_write_status(FILE *f);
+
 /* client.c */
 extern void tlshd_clienthello_handshake(struct tlshd_handshake_parms *parms);
 
+/* cost.c */
+extern void tlshd_cost_init(void);
+extern void tlshd_cost_shutdown(void);
+extern void tlshd_cost_begin(void);
+extern void tlshd_cost_count_io(void);
+extern void tlshd_cost_gnutls_begin(void);
+extern void tlshd_cost_gnutls_end(gnutls_session_t session);
+extern void tlshd_cost_end(const struct tlshd_handshake_parms *parms);
+extern void tlshd_cost_write_metrics(FILE *f);
+
+/* control.c */
+extern bool tlshd_control_execute(char *request, FILE *out);
+
 /* config.c */
 bool tlshd_config_init(const gchar *pathname);
 void tlshd_config_shutdown(void);
-bool tlshd_config_get_client_cert(gnutls_pcert_st *cert);
-bool tlshd_config_get_client_privkey(gnutls_privkey_t *privkey);
-bool tlshd_config_get_server_cert(gnutls_pcert_st *cert);
-bool tlshd_config_get_server_privkey(gnutls_privkey_t *privkey);
+bool tlshd_config_get_client_certs(gnutls_pcert_st *certs,
+				   unsigned int *count);
+bool tlshd_config_get_client_privkeys(gnutls_privkey_t *privkeys,
+				      unsigned int *count);
+bool tlshd_config_get_server_certs(gnutls_pcert_st *certs,
+				   unsigned int *count);
+bool tlshd_config_get_server_privkeys(gnutls_privkey_t *privkeys,
+				      unsigned int *count);
+bool tlshd_config_get_session_tickets(unsigned int *lifetime);
+bool tlshd_config_get_ticket_key(gnutls_datum_t *key);
+bool tlshd_config_get_key_share_prediction(void);
+bool tlshd_config_get_tune_handshake(void);
+gchar *tlshd_config_get_metrics_socket(void);
+gchar *tlshd_config_get_control_socket(void);
+bool tlshd_config_get_log_handshake_cost(void);
+bool tlshd_config_get_log_rate_limit(unsigned int *rate, unsigned int *burst);
+bool tlshd_config_get_tls_trace(int *level, unsigned int *threshold_ms);
+gchar *tlshd_config_get_handshake_events(void);
+bool tlshd_config_get_rawpk_privkey(int handshake_type,
+				    gnutls_privkey_t *privkey);
+bool tlshd_config_get_rawpk_pins(int handshake_type, gnutls_datum_t *data);
+#ifdef HAVE_GNUTLS_COMPRESS_CERTIFICATE_SET_METHODS
+void tlshd_config_get_cert_compression(int handshake_type,
+				       gnutls_compression_method_t *methods,
+				       size_t *count);
+#endif
+gchar **tlshd_config_get_ktls_ciphers(gsize *length);
+bool tlshd_config_get_ktls_benchmark(void);
+bool tlshd_config_get_ktls_bool(int auth_mode, const char *key);
+gchar **tlshd_config_get_ktls_list(int auth_mode, const char *key,
+				   gsize *length);
+uint64_t tlshd_config_get_ktls_uint64(int auth_mode, const char *key);
+
+/* events.c */
+extern void tlshd_events_init(void);
+extern void tlshd_events_shutdown(void);
+extern void tlshd_events_capture(gnutls_session_t session,
+				 struct tlshd_handshake_parms *parms);
+extern void tlshd_events_write(const struct tlshd_handshake_parms *parms);
 
 /* handshake.c */
+extern unsigned int tlshd_x509_select_identity(const gnutls_pcert_st *certs,
+						unsigned int count,
+						const gnutls_pk_algorithm_t *pk_algos,
+						int pk_algos_length);
+extern bool tlshd_x509_save_peers(gnutls_session_t session,
+				  const char *hostname, key_serial_t *peerids,
+				  unsigned int max, unsigned int *num_peerids);
+extern void tlshd_set_cert_compression(gnutls_session_t session,
+				       struct tlshd_handshake_parms *parms);
 extern void tlshd_start_tls_handshake(gnutls_session_t session,
 				      struct tlshd_handshake_parms *parms);
 extern void tlshd_service_socket(void);
@@ -73,20 +180,44 @@ extern key_serial_t tlshd_keyring_create_cert(gnutls_x509_crt_t cert,
 extern int tlshd_keyring_link_session(const char *keyring);
 
 /* ktls.c */
-extern int tlshd_initialize_ktls(gnutls_session_t session);
+extern void tlshd_ktls_init(void);
+extern void tlshd_ktls_refresh(void);
+extern bool tlshd_ktls_available(void);
+extern uint64_t tlshd_ktls_kernel_stat(const char *name);
+extern int tlshd_initialize_ktls(gnutls_session_t session,
+				 struct tlshd_handshake_parms *parms);
+extern void tlshd_set_record_size_limit(gnutls_session_t session,
+					struct tlshd_handshake_parms *parms);
 extern char *tlshd_make_priorities_string(struct tlshd_handshake_parms *parms);
+extern char *tlshd_prefer_group(const char *priorities, int group);
+
+/* latency.c */
+extern void tlshd_latency_init(void);
+extern void tlshd_latency_shutdown(void);
+extern void tlshd_latency_start(struct tlshd_handshake_parms *parms);
+extern void tlshd_latency_mark(struct tlshd_handshake_parms *parms,
+			       enum tlshd_phase phase);
+extern void tlshd_latency_finish(void);
+extern void tlshd_latency_write_metrics(FILE *f);
+extern const char *tlshd_latency_phase_name(enum tlshd_phase phase);
+extern void tlshd_latency_write_in_flight(FILE *f);
 
 /* log.c */
 extern void tlshd_log_init(const char *progname);
 extern void tlshd_log_shutdown(void);
 extern void tlshd_log_close(void);
 
-extern void tlshd_log_success(const char *hostname,
-			      const struct sockaddr *sap, socklen_t salen);
-extern void tlshd_log_failure(const char *hostname,
-			      const struct sockaddr *sap, socklen_t salen);
+extern void tlshd_log_success(const char *hostname, const char *addr);
+extern void tlshd_log_failure(const char *hostname, const char *addr);
 
 extern void tlshd_log_debug(const char *fmt, ...);
+extern void tlshd_log_notice(const char *fmt, ...);
+extern void tlshd_log_ratelimit_init(void);
+extern bool tlshd_log_trace_header(const char *fmt, ...)
+	__attribute__ ((format (printf, 1, 2)));
+extern void tlshd_log_trace(const char *fmt, ...)
+	__attribute__ ((format (printf, 1, 2)));
+extern const char *tlshd_log_cert_status_name(unsigned int bit);
 extern void tlshd_log_error(const char *fmt, ...);
 extern void tlshd_log_perror(const char *prefix);
 extern void tlshd_log_gai_error(int error);
@@ -99,15 +230,121 @@ extern void tlshd_gnutls_audit_func(gnutls_session_t session, const char *msg);
 void tlshd_log_gerror(const char *msg, GError *error);
 void tlshd_log_nl_error(const char *msg, int err);
 
+/* metrics.c */
+extern void tlshd_metrics_init(void);
+extern void tlshd_metrics_shutdown(void);
+
 /* netlink.c */
 extern void tlshd_genl_dispatch(void);
 extern int tlshd_genl_get_handshake_parms(struct tlshd_handshake_parms *parms);
 extern void tlshd_genl_done(struct tlshd_handshake_parms *parms);
 
+/* rawpk.c */
+extern void tlshd_rawpk_init(void);
+extern void tlshd_rawpk_shutdown(void);
+extern bool tlshd_rawpk_enabled(struct tlshd_handshake_parms *parms);
+extern void tlshd_rawpk_handshake(struct tlshd_handshake_parms *parms,
+				  unsigned int flags);
+
 /* server.c */
 extern void tlshd_serverhello_handshake(struct tlshd_handshake_parms *parms);
 
+/* stats.c */
+enum tlshd_stat {
+	TLSHD_STAT_KEYSHARE_PREDICTED,
+	TLSHD_STAT_HRR,
+	TLSHD_STAT_HRR_PREDICTED,
+	TLSHD_STAT_TX_ZEROCOPY,
+	TLSHD_STAT_TX_ZEROCOPY_FAILED,
+	TLSHD_STAT_RX_NO_PAD,
+	TLSHD_STAT_HANDSHAKES_TUNED,
+	TLSHD_STAT_HANDSHAKES_UNTUNED,
+	TLSHD_STAT_HANDSHAKE_USEC_TUNED,
+	TLSHD_STAT_HANDSHAKE_USEC_UNTUNED,
+	TLSHD_STAT_CERT_COMPRESSED_SENT,
+	TLSHD_STAT_CERT_COMPRESSED_RECEIVED,
+	TLSHD_STAT_CERT_COMPRESSION_SAVED,
+	TLSHD_STAT_ABANDONED_LOOKUP,
+	TLSHD_STAT_ABANDONED_CREDENTIALS,
+	TLSHD_STAT_ABANDONED_HANDSHAKE,
+	TLSHD_STAT_HANDSHAKES_STARTED,
+	TLSHD_STAT_HANDSHAKES_SUCCEEDED,
+	TLSHD_STAT_FAILED_LOOKUP,
+	TLSHD_STAT_FAILED_SETUP,
+	TLSHD_STAT_FAILED_HANDSHAKE,
+	TLSHD_STAT_FAILED_KTLS,
+	TLSHD_STAT_CIPHER_CHACHA20_POLY1305,
+	TLSHD_STAT_CIPHER_AES_GCM_256,
+	TLSHD_STAT_CIPHER_AES_GCM_128,
+	TLSHD_STAT_CIPHER_AES_CCM_128,
+	TLSHD_STAT_CIPHER_SM4_GCM,
+	TLSHD_STAT_CIPHER_SM4_CCM,
+	TLSHD_STAT_BYTES_SENT,
+	TLSHD_STAT_BYTES_RECEIVED,
+	TLSHD_STAT_IN_FLIGHT,
+	TLSHD_STAT_SESSIONS_RESUMED,
+	TLSHD_STAT_LOG_DROPPED,
+	TLSHD_STAT_LOG_SUPPRESSED_FAILURE,
+	TLSHD_STAT_LOG_SUPPRESSED_CERT,
+	TLSHD_STAT_LOG_SUPPRESSED_GNUTLS,
+	TLSHD_STAT_LOG_SUPPRESSED_TRACE,
+
+	TLSHD_STAT_MAX
+};
+
+extern void tlshd_stats_init(void);
+extern void tlshd_stats_shutdown(void);
+extern void tlshd_stats_worker(void);
+extern void tlshd_stats_inc(enum tlshd_stat stat);
+extern void tlshd_stats_add(enum tlshd_stat stat, uint64_t value);
+extern uint64_t tlshd_stats_get(enum tlshd_stat stat);
+extern void tlshd_stats_gnutls_error(int error);
+extern void tlshd_stats_cert_status(unsigned int status);
+extern void tlshd_stats_write_metrics(FILE *f);
+
+/* ticket.c */
+extern void tlshd_ticket_init(void);
+extern void tlshd_ticket_shutdown(void);
+extern bool tlshd_ticket_enabled(struct tlshd_handshake_parms *parms);
+extern bool tlshd_ticket_enable_server(gnutls_session_t session);
+extern void tlshd_ticket_write_status(FILE *f);
+
+/* trace.c */
+extern void tlshd_trace_begin(void);
+extern bool tlshd_trace_capture(int level, const char *msg);
+extern void tlshd_trace_end(const struct tlshd_handshake_parms *parms);
+
+/* Bits in tlshd_handshake_parms.ktls_flags */
+#define TLSHD_KTLS_TX_ZEROCOPY		(1U << 0)
+#define TLSHD_KTLS_RX_NO_PAD		(1U << 1)
+
 #define TLS_DEFAULT_PRIORITIES	(NULL)
 #define TLS_NO_PEERID		(0)
 #define TLS_NO_CERT		(0)
 #define TLS_NO_PRIVKEY		(0)
+
+/* Size of a GnuTLS session ticket master key, in bytes */
+#define TLSHD_TICKET_KEY_SIZE		(64)
+#define TLSHD_DEFAULT_TICKET_LIFETIME	(21600)
+
+#define TLSHD_CACHE_ENTRIES		(256)
+#define TLSHD_CACHE_PROBES		(8)
+#define TLSHD_DEFAULT_LOG_RATE_LIMIT	(10)
+#define TLSHD_DEFAULT_LOG_RATE_BURST	(50)
+
+#define TLSHD_BENCH_RECORD_SIZE		(16384)
+#define TLSHD_BENCH_BYTES		(4 * 1024 * 1024)
+#define TLSHD_BENCH_TIMEOUT_MS		(1000)
+#define TLSHD_KTLS_REFRESH_SECS		(10)
+
+/* Range of record_size_limit, from RFC 8449 */
+#define TLSHD_RECORD_SIZE_MIN		(64)
+#define TLSHD_RECORD_SIZE_MAX		(16384)
+
+#define TLSHD_MAX_CERT_COMPRESSION	(3)
+
+/* Number of x.509 identities that may be configured per role */
+#define TLSHD_MAX_IDENTITIES		(4)
+
+/* Pinned raw public keys are identified by SHA-256 digest */
+#define TLSHD_RAWPK_PIN_SIZE		(32)
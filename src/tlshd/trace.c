@@ -0,0 +1,176 @@
+/*
+ * Keep GnuTLS debug messages for handshakes that fail or run slow.
+ *
+ * Copyright (c) 2023 Oracle and/or its affiliates.
+ *
+ * ktls-utils is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <keyutils.h>
+
+#include <gnutls/gnutls.h>
+#include <gnutls/abstract.h>
+
+#include <glib.h>
+
+#include "tlshd.h"
+
+/* Only the most recent messages are kept when a trace overflows */
+#define TLSHD_TRACE_SIZE	(32768)
+
+#define TLSHD_TRACE_LINE	(400)
+
+/*
+ * Each handshake child captures its own trace, so this state is
+ * private to the child and needs no locking.
+ */
+static struct {
+	bool			capturing;
+	unsigned int		threshold_ms;
+	uint64_t		written;
+	char			buf[TLSHD_TRACE_SIZE];
+} tlshd_trace;
+
+/**
+ * tlshd_trace_begin - Start capturing GnuTLS debug messages
+ *
+ * Called in a handshake child once GnuTLS is initialized. When the
+ * "tlsdebug" setting is non-zero, every message is already logged
+ * as it arrives, and nothing is captured.
+ */
+void tlshd_trace_begin(void)
+{
+	int level;
+
+	if (tlshd_tls_debug)
+		return;
+	if (!tlshd_config_get_tls_trace(&level, &tlshd_trace.threshold_ms))
+		return;
+
+	tlshd_trace.written = 0;
+	tlshd_trace.capturing = true;
+	gnutls_global_set_log_level(level);
+}
+
+/**
+ * tlshd_trace_capture - Save a GnuTLS debug message
+ * @level: log level
+ * @msg: message to save
+ *
+ * Return values:
+ *   %true: @msg has been captured
+ *   %false: No trace is being captured; log @msg as usual
+ */
+bool tlshd_trace_capture(int level, const char *msg)
+{
+	char line[TLSHD_TRACE_LINE];
+	uint64_t pos;
+	int len, i;
+
+	if (!tlshd_trace.capturing)
+		return false;
+
+	len = snprintf(line, sizeof(line), "gnutls(%d): %s", level, msg);
+	if (len >= (int)sizeof(line)) {
+		len = sizeof(line) - 1;
+		line[len - 1] = '\n';
+	}
+
+	pos = tlshd_trace.written;
+	for (i = 0; i < len; i++)
+		tlshd_trace.buf[(pos + i) % TLSHD_TRACE_SIZE] = line[i];
+	tlshd_trace.written = pos + len;
+	return true;
+}
+
+static void tlshd_trace_flush(void)
+{
+	char line[TLSHD_TRACE_LINE];
+	uint64_t pos, end;
+	unsigned int len;
+	char c;
+
+	end = tlshd_trace.written;
+	pos = 0;
+	if (end > TLSHD_TRACE_SIZE) {
+		/* Skip the remains of the oldest, partly overwritten line */
+		pos = end - TLSHD_TRACE_SIZE;
+		while (pos < end && tlshd_trace.buf[pos % TLSHD_TRACE_SIZE] != '\n')
+			pos++;
+		pos++;
+		tlshd_log_trace("... %llu earlier bytes discarded",
+				(unsigned long long)pos);
+	}
+
+	len = 0;
+	for (; pos < end; pos++) {
+		c = tlshd_trace.buf[pos % TLSHD_TRACE_SIZE];
+		if (c != '\n' && len < sizeof(line) - 1) {
+			line[len++] = c;
+			continue;
+		}
+		line[len] = '\0';
+		if (len)
+			tlshd_log_trace("%s", line);
+		len = 0;
+	}
+	if (len) {
+		line[len] = '\0';
+		tlshd_log_trace("%s", line);
+	}
+}
+
+/**
+ * tlshd_trace_end - Log or discard the captured trace
+ * @parms: handshake parameters
+ *
+ * Called once the kernel has been told the outcome. The trace is
+ * logged if the handshake failed or took at least as long as the
+ * configured threshold, and is discarded otherwise.
+ */
+void tlshd_trace_end(const struct tlshd_handshake_parms *parms)
+{
+	uint64_t elapsed_ms;
+	bool failed;
+
+	if (!tlshd_trace.capturing)
+		return;
+	tlshd_trace.capturing = false;
+
+	/* Abandoned handshakes say nothing about TLS */
+	failed = parms->session_status && parms->session_status != ENOTCONN;
+	elapsed_ms = parms->phase_durations_ns[TLSHD_PHASE_TOTAL] / 1000000;
+	if (!failed &&
+	    (!tlshd_trace.threshold_ms || elapsed_ms < tlshd_trace.threshold_ms))
+		return;
+
+	if (!tlshd_log_trace_header("GnuTLS trace of %s handshake with '%s' (%s), %llu msec:",
+				    failed ? "failed" : "slow",
+				    parms->peername ? parms->peername : "unknown",
+				    parms->peeraddr_text ? parms->peeraddr_text : "unknown",
+				    (unsigned long long)elapsed_ms))
+		return;
+	tlshd_trace_flush();
+}